@@ -0,0 +1,251 @@
+/*
+ * Optional C accelerator for pixelflut.py
+ *
+ * Parses raw client input and applies all well-formed `PX x y rrggbb(aa)`
+ * commands directly to the pixel buffer of a pygame surface. Everything else
+ * (PX reads, other commands, malformed input) is returned to python as a list
+ * of lines, so the brain.py hooks still get to see it.
+ *
+ * Build with: python setup.py build_ext --inplace
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdint.h>
+#include <string.h>
+
+// Lines longer than this are split, just like socket.makefile().readline(1024)
+#define PX_MAX_LINE 1024
+
+#if PY_MAJOR_VERSION >= 3
+#define PyLine_FromStringAndSize PyBytes_FromStringAndSize
+#else
+#define PyLine_FromStringAndSize PyString_FromStringAndSize
+#endif
+
+typedef struct PxTarget {
+	uint8_t *pixels;
+	Py_ssize_t len;
+	unsigned int pitch;
+	unsigned int bytesize;
+	unsigned int width;
+	unsigned int height;
+	unsigned int rshift;
+	unsigned int gshift;
+	unsigned int bshift;
+} PxTarget;
+
+// Decimal string to unsigned int. Does NOT consume +, - or whitespace.
+// Returns the number of digits consumed, or 0 on error or overflow.
+static inline int px_parse_dec(const char *str, const char *end, uint32_t *out) {
+	const char *start = str;
+	uint32_t result = 0;
+	unsigned char c;
+	for (; str < end && (c = *str - '0') <= 9; str++) {
+		if (str - start >= 9)
+			return 0;
+		result = result * 10 + c;
+	}
+	*out = result;
+	return str - start;
+}
+
+// Same as px_parse_dec, but for hex strings.
+static inline int px_parse_hex(const char *str, const char *end, uint32_t *out) {
+	const char *start = str;
+	uint32_t result = 0;
+	unsigned char c;
+	for (; str < end; str++) {
+		if ((c = *str - '0') <= 9) // 0-9
+			;
+		else if ((c = (*str | 0x20) - 'a') <= 5) // a-f or A-F
+			c += 10;
+		else
+			break;
+		if (str - start >= 8)
+			return 0;
+		result = result * 16 + c;
+	}
+	*out = result;
+	return str - start;
+}
+
+static inline uint32_t px_read(const uint8_t *p, unsigned int bytesize) {
+	if (bytesize == 4) {
+		uint32_t v;
+		memcpy(&v, p, 4);
+		return v;
+	}
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return (p[0] << 16) | (p[1] << 8) | p[2];
+#else
+	return p[0] | (p[1] << 8) | (p[2] << 16);
+#endif
+}
+
+static inline void px_write(uint8_t *p, unsigned int bytesize, uint32_t v) {
+	if (bytesize == 4) {
+		memcpy(p, &v, 4);
+		return;
+	}
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	p[0] = v >> 16; p[1] = v >> 8; p[2] = v;
+#else
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16;
+#endif
+}
+
+// Same semantics as Canvas.set_pixel()
+static inline void px_set(PxTarget *t, uint32_t x, uint32_t y, uint32_t r,
+		uint32_t g, uint32_t b, uint32_t a) {
+	if (a == 0 || x >= t->width || y >= t->height)
+		return;
+
+	Py_ssize_t offset = (Py_ssize_t) y * t->pitch + (Py_ssize_t) x * t->bytesize;
+	if (offset + t->bytesize > t->len)
+		return;
+
+	uint8_t *p = t->pixels + offset;
+	uint32_t old = px_read(p, t->bytesize);
+	uint32_t mask = (0xffu << t->rshift) | (0xffu << t->gshift) | (0xffu << t->bshift);
+
+	if (a < 0xff) {
+		uint32_t na = 0xff - a;
+		r = (((old >> t->rshift) & 0xff) * na + r * a) / 0xff;
+		g = (((old >> t->gshift) & 0xff) * na + g * a) / 0xff;
+		b = (((old >> t->bshift) & 0xff) * na + b * a) / 0xff;
+	}
+
+	px_write(p, t->bytesize, (old & ~mask) | (r << t->rshift)
+			| (g << t->gshift) | (b << t->bshift));
+}
+
+// Try to apply a single line as a `PX x y color` command.
+// Return 1 if the line was handled, 0 if it should be passed on to python.
+static int px_apply_line(PxTarget *t, const char *line, const char *end) {
+	uint32_t x, y, c;
+	int n;
+
+	while (end > line && (end[-1] == '\r' || end[-1] == ' '))
+		end--;
+
+	if (end - line < 3 || memcmp(line, "PX ", 3) != 0)
+		return 0;
+	line += 3;
+
+	if (!(n = px_parse_dec(line, end, &x)) || (line += n) >= end || *line++ != ' ')
+		return 0;
+	if (!(n = px_parse_dec(line, end, &y)) || (line += n) >= end || *line++ != ' ')
+		return 0;
+	if (!(n = px_parse_hex(line, end, &c)) || line + n != end)
+		return 0;
+
+	if (n == 6)
+		px_set(t, x, y, (c >> 16) & 0xff, (c >> 8) & 0xff, c & 0xff, 0xff);
+	else if (n == 8)
+		px_set(t, x, y, c >> 24, (c >> 16) & 0xff, (c >> 8) & 0xff, c & 0xff);
+	else
+		return 0;
+
+	return 1;
+}
+
+PyDoc_STRVAR(pxaccel_process_doc,
+"process(buffer, pitch, bytesize, shifts, size, data, limit)\n\
+\n\
+Process up to `limit` complete lines of `data`. PX commands that set a pixel\n\
+are applied to the writeable surface `buffer` directly. Returns a\n\
+(consumed_bytes, pixel_count, other_lines) tuple.");
+
+static PyObject* pxaccel_process(PyObject *self, PyObject *args) {
+	Py_buffer surface, input;
+	PxTarget t;
+	Py_ssize_t limit;
+	PyObject *lines, *result;
+	long pixels = 0;
+
+	if (!PyArg_ParseTuple(args, "w*II(III)(II)s*n", &surface, &t.pitch,
+			&t.bytesize, &t.rshift, &t.gshift, &t.bshift, &t.width, &t.height,
+			&input, &limit))
+		return NULL;
+
+	if ((t.bytesize != 3 && t.bytesize != 4) || t.rshift > 24 || t.gshift > 24
+			|| t.bshift > 24) {
+		PyBuffer_Release(&surface);
+		PyBuffer_Release(&input);
+		PyErr_SetString(PyExc_ValueError, "Unsupported pixel format");
+		return NULL;
+	}
+
+	t.pixels = surface.buf;
+	t.len = surface.len;
+
+	if (!(lines = PyList_New(0))) {
+		PyBuffer_Release(&surface);
+		PyBuffer_Release(&input);
+		return NULL;
+	}
+
+	const char *data = input.buf;
+	const char *end = data + input.len;
+	const char *pos = data;
+
+	while (limit-- > 0 && pos < end) {
+		Py_ssize_t avail = end - pos;
+		const char *eol = memchr(pos, '\n',
+				avail < PX_MAX_LINE ? avail : PX_MAX_LINE);
+		const char *next;
+
+		if (eol) {
+			next = eol + 1;
+		} else if (avail >= PX_MAX_LINE) {
+			eol = next = pos + PX_MAX_LINE;
+		} else {
+			break; // Incomplete line. Wait for more data.
+		}
+
+		if (px_apply_line(&t, pos, eol)) {
+			pixels++;
+		} else if (eol > pos) {
+			PyObject *line = PyLine_FromStringAndSize(pos, eol - pos);
+			if (!line || PyList_Append(lines, line) < 0) {
+				Py_XDECREF(line);
+				Py_DECREF(lines);
+				PyBuffer_Release(&surface);
+				PyBuffer_Release(&input);
+				return NULL;
+			}
+			Py_DECREF(line);
+		}
+
+		pos = next;
+	}
+
+	result = Py_BuildValue("(nlN)", (Py_ssize_t) (pos - data), pixels, lines);
+	PyBuffer_Release(&surface);
+	PyBuffer_Release(&input);
+	return result;
+}
+
+static PyMethodDef pxaccel_methods[] = {
+	{"process", pxaccel_process, METH_VARARGS, pxaccel_process_doc},
+	{NULL, NULL, 0, NULL}
+};
+
+#if PY_MAJOR_VERSION >= 3
+
+static struct PyModuleDef pxaccel_module = {
+	PyModuleDef_HEAD_INIT, "_pxaccel", NULL, -1, pxaccel_methods
+};
+
+PyMODINIT_FUNC PyInit__pxaccel(void) {
+	return PyModule_Create(&pxaccel_module);
+}
+
+#else
+
+PyMODINIT_FUNC init_pxaccel(void) {
+	Py_InitModule("_pxaccel", pxaccel_methods);
+}
+
+#endif
@@ -89,6 +89,12 @@ def on_quit(canvas, client, mode):
     else:
         client.pps = 1000
 
+@on('PIXELS')
+def on_pixels(canvas, client, count):
+    # PX commands applied by the C accelerator (see _pxaccel.c)
+    global pixelcount
+    pixelcount += count
+
 @on('COMMAND-PX')
 def on_px(canvas, client, x, y, color=None):
     global pixelcount
@@ -19,6 +19,11 @@ import os.path
 import logging
 log = logging.getLogger('pixelflut')
 
+try:
+    import _pxaccel
+except ImportError:
+    _pxaccel = None
+
 async = spawn
 
 class Client(object):
@@ -55,6 +60,9 @@ class Client(object):
             self.socket = socket
             readline = self.socket.makefile().readline
 
+        if self.canvas.accelerated:
+            return self.serve_accelerated(socket)
+
         try:
             while self.socket:
                 gsleep(10.0/self.pps)
@@ -69,6 +77,35 @@ class Client(object):
         finally:
             self.disconnect()
 
+    def serve_accelerated(self, socket):
+        ''' Same as the readline loop in serve(), but PX commands are parsed
+            and applied by the C accelerator. Only the remaining lines are
+            dispatched as COMMAND-* events. '''
+        buffer = ''
+        try:
+            while self.socket:
+                gsleep(10.0/self.pps)
+                consumed, pixels, lines = self.canvas.feed(buffer, 10)
+                if not consumed:
+                    chunk = socket.recv(4096)
+                    if not chunk:
+                        break
+                    buffer += chunk
+                    continue
+                buffer = buffer[consumed:]
+                if pixels:
+                    self.canvas.fire('PIXELS', self, pixels)
+                for line in lines:
+                    arguments = line.split()
+                    if not arguments:
+                        continue
+                    command = arguments.pop(0)
+                    if not self.canvas.fire('COMMAND-%s' % command.upper(), self, *arguments):
+                        self.disconnect()
+                        break
+        finally:
+            self.disconnect()
+
 
 
 
@@ -88,6 +125,17 @@ class Canvas(object):
         self.clients = {}
         self.events = {}
         self.font = pygame.font.Font(None, 17)
+        self._setup_accel()
+
+    def _setup_accel(self):
+        ''' Check if the C accelerator can write to the current screen. '''
+        self.accelerated = bool(_pxaccel) \
+            and self.screen.get_bytesize() in (3, 4) \
+            and self.screen.get_losses()[:3] == (0, 0, 0)
+        if self.accelerated:
+            self.accel_format = (self.screen.get_pitch(),
+                                 self.screen.get_bytesize(),
+                                 self.screen.get_shifts()[:3])
 
     def serve(self, host, port):
         self.host = host
@@ -126,6 +174,7 @@ class Canvas(object):
                     self.screen = pygame.display.set_mode(e.size, self.flags)
                     self.screen.blit(old, (0,0))
                     self.width, self.height = e.size
+                    self._setup_accel()
                     self.fire('RESIZE')
                 elif e.type == pygame.QUIT:
                     self.fire('QUIT')
@@ -181,6 +230,18 @@ class Canvas(object):
             b = (b2*(0xff-a)+(b*a)) / 0xff
             self.screen.set_at((x, y), (r,g,b))
 
+    def feed(self, data, limit):
+        ''' Process up to `limit` lines of raw client input with the C
+            accelerator. PX commands that set a pixel are applied directly.
+            Returns a (consumed_bytes, pixel_count, other_lines) tuple. '''
+        pitch, bytesize, shifts = self.accel_format
+        buffer = self.screen.get_buffer()
+        try:
+            return _pxaccel.process(buffer, pitch, bytesize, shifts,
+                                    (self.width, self.height), data, limit)
+        finally:
+            del buffer
+
     def clear(self, r=0, g=0, b=0, a=255):
         ''' Fill the entire screen with a solid colour (default: black)'''
         self.screen.fill((r, g, b))
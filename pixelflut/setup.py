@@ -0,0 +1,8 @@
+# Builds the optional C accelerator for pixelflut.py:
+#   python setup.py build_ext --inplace
+
+from distutils.core import setup, Extension
+
+setup(name='pixelflut',
+      ext_modules=[Extension('_pxaccel', ['_pxaccel.c'],
+                             extra_compile_args=['-O2'])])
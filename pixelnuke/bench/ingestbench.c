@@ -0,0 +1,66 @@
+// Example producer for the local ingest channel: Push random pixels and
+// rectangles into a running pixelnuke (started with -u <socket>) and report
+// the rate.
+//
+// Usage: ./ingestbench <socket> [pixels] [texsize]
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "ingest.h"
+
+#define BATCH 4096
+
+int main(int argc, char **argv) {
+	IngestProducer p;
+	IngestPixel px[BATCH];
+	uint32_t rect[64 * 64];
+	long pixels = argc > 2 ? atol(argv[2]) : 100000000;
+	unsigned int size = argc > 3 ? atoi(argv[3]) : 1024;
+	uint32_t seed = 2463534242u;
+	struct timespec t1, t2;
+
+	if (argc < 2) {
+		printf("Usage: %s <socket> [pixels] [texsize]\n", argv[0]);
+		return 1;
+	}
+
+	if (ingest_connect(&p, argv[1]) != 0) {
+		perror("Failed to connect");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	for (long done = 0; done < pixels; done += BATCH) {
+		for (int i = 0; i < BATCH; i++) {
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			px[i].x = seed % size;
+			px[i].y = (seed >> 16) % size;
+			px[i].rgba = (seed << 8) | 0xff;
+		}
+		ingest_pixels(&p, px, BATCH);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	double sec = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+	printf("pixels: %.1f Mpx/s\n", pixels / sec / 1e6);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	long rects = pixels / (64 * 64);
+	for (long r = 0; r < rects; r++) {
+		for (int i = 0; i < 64 * 64; i++)
+			rect[i] = ((uint32_t) r << 8) | 0xff;
+		ingest_rect(&p, (r * 64) % (size - 64), (r * 7) % (size - 64), 64, 64, rect);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	sec = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+	printf("rects:  %.1f Mpx/s\n", rects * 64 * 64 / sec / 1e6);
+
+	ingest_disconnect(&p);
+	return 0;
+}
@@ -0,0 +1,217 @@
+// Compare the specialized canvas kernels against the previous generic pixel
+// functions (format and alpha checks per pixel), and the span kernels of all
+// instruction set levels supported by this CPU. Also checks that all variants
+// produce identical canvas contents.
+//
+// Random single pixel writes are dominated by cache misses, so expect the
+// set/blend and get numbers to be within noise of the generic code. The
+// speedup is in the span kernels (fill).
+//
+// Usage: ./kernelbench [texsize] [writes]
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "kernel.h"
+
+#define FORMAT_RGB 3
+#define FORMAT_RGBA 4
+
+// Map 16 random bits to [0, n) without a (slow) division
+#define RAND_COORD(bits, n) (((bits) * (n)) >> 16)
+
+// The previous implementation, as it was in canvas.c
+
+typedef struct RefLayer {
+	unsigned int size;
+	int format;
+	uint8_t *data;
+} RefLayer;
+
+static inline uint8_t* ref_offset(RefLayer *layer, unsigned int x, unsigned int y) {
+	if (x >= layer->size || y >= layer->size || layer->data == NULL)
+		return NULL;
+	return layer->data + ((y * layer->size) + x) * (layer->format == FORMAT_RGBA ? 4 : 3);
+}
+
+// Not inlined, like a call into canvas.c
+__attribute__((noinline))
+static void ref_set_px(RefLayer *layer, unsigned int x, unsigned int y, uint32_t rgba) {
+	uint8_t *ptr = ref_offset(layer, x, y);
+	if (ptr == NULL)
+		return;
+
+	uint8_t r = (rgba & 0xff000000) >> 24;
+	uint8_t g = (rgba & 0x00ff0000) >> 16;
+	uint8_t b = (rgba & 0x0000ff00) >> 8;
+	uint8_t a = (rgba & 0x000000ff) >> 0;
+
+	if (layer->format == FORMAT_RGBA) {
+		ptr[0] = r;
+		ptr[1] = g;
+		ptr[2] = b;
+		ptr[3] = a;
+		return;
+	}
+	if (a == 0)
+		return;
+	if (a < 0xff) {
+		unsigned int na = 0xff - a;
+		r = (a * r + na * (ptr[0])) / 0xff;
+		g = (a * g + na * (ptr[1])) / 0xff;
+		b = (a * b + na * (ptr[2])) / 0xff;
+	}
+	ptr[0] = r;
+	ptr[1] = g;
+	ptr[2] = b;
+}
+
+__attribute__((noinline))
+static void ref_get_px(RefLayer *layer, unsigned int x, unsigned int y, uint32_t *rgba) {
+	uint8_t *ptr = ref_offset(layer, x, y);
+	if (ptr == NULL)
+		*rgba = 0;
+	else
+		*rgba = (ptr[0] << 24) + (ptr[1] << 16) + (ptr[2] << 8) + 0xff;
+}
+
+static void ref_fill(RefLayer *layer, uint32_t rgba) {
+	for (unsigned int x = 0; x < layer->size; x++)
+		for (unsigned int y = 0; y < layer->size; y++)
+			ref_set_px(layer, x, y, rgba);
+}
+
+// Helper functions
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline uint32_t xorshift(uint32_t *seed) {
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+static void report(const char *name, const char *variant, double sec, long count) {
+	printf("%-14s %-20s %8.1f Mpx/s  %6.2f ns/px\n", name, variant,
+			count / sec / 1e6, sec * 1e9 / count);
+}
+
+// Random writes with 1 in 8 pixels translucent, like a typical mix of
+// RRGGBB and RRGGBBAA commands. Coordinates may be out of bounds.
+static void bench_set(unsigned int size, long writes) {
+	size_t mem = (size_t) size * size * 3;
+	uint8_t *a = calloc(1, mem), *b = calloc(1, mem);
+	RefLayer ref = { size, FORMAT_RGB, a };
+	Kernels k;
+	uint32_t seed;
+	double t;
+
+	if (a == NULL || b == NULL)
+		exit(1);
+	kernel_select(&k, b, size, FORMAT_RGB, KERNEL_ISA_BEST);
+
+	seed = 2463534242u;
+	t = now();
+	for (long i = 0; i < writes; i++) {
+		uint32_t r = xorshift(&seed);
+		uint32_t c = r & 7 ? (r << 8) | 0xff : (r << 8) | 0x80;
+		ref_set_px(&ref, RAND_COORD(r & 0xffff, size + 8), RAND_COORD(r >> 16, size + 8), c);
+	}
+	report("set/blend", "generic", now() - t, writes);
+
+	seed = 2463534242u;
+	t = now();
+	for (long i = 0; i < writes; i++) {
+		uint32_t r = xorshift(&seed);
+		// The parser picks the kernel by the length of the color code.
+		kernel_set_px kernel = r & 7 ? k.set : k.blend;
+		uint32_t c = r & 7 ? (r << 8) | 0xff : (r << 8) | 0x80;
+		kernel(&k.layer, RAND_COORD(r & 0xffff, size + 8), RAND_COORD(r >> 16, size + 8), c);
+	}
+	report("set/blend", k.name, now() - t, writes);
+
+	if (memcmp(a, b, mem) != 0)
+		printf("ERROR: set/blend results differ\n");
+
+	uint32_t sum = 0, c;
+	seed = 2463534242u;
+	t = now();
+	for (long i = 0; i < writes; i++) {
+		uint32_t r = xorshift(&seed);
+		ref_get_px(&ref, RAND_COORD(r & 0xffff, size), RAND_COORD(r >> 16, size), &c);
+		sum += c;
+	}
+	report("get", "generic", now() - t, writes);
+
+	seed = 2463534242u;
+	t = now();
+	for (long i = 0; i < writes; i++) {
+		uint32_t r = xorshift(&seed);
+		sum -= k.get(&k.layer, RAND_COORD(r & 0xffff, size), RAND_COORD(r >> 16, size));
+	}
+	report("get", k.name, now() - t, writes);
+
+	if (sum != 0)
+		printf("ERROR: get results differ\n");
+
+	free(a);
+	free(b);
+}
+
+// Blend a translucent color over the whole canvas (the 'c' key)
+static void bench_fill(unsigned int size) {
+	size_t mem = (size_t) size * size * 3;
+	uint8_t *a = malloc(mem), *b = malloc(mem);
+	RefLayer ref = { size, FORMAT_RGB, a };
+	Kernels k;
+	int rounds = 8;
+	double t;
+
+	if (a == NULL || b == NULL)
+		exit(1);
+	for (size_t i = 0; i < mem; i++)
+		a[i] = i * 7;
+
+	memcpy(b, a, mem);
+	t = now();
+	for (int i = 0; i < rounds; i++)
+		ref_fill(&ref, 0x10203088);
+	report("fill", "generic (old)", now() - t, (long) size * size * rounds);
+
+	for (int isa = KERNEL_ISA_GENERIC; isa <= kernel_detect_isa(); isa++) {
+		uint8_t *c = malloc(mem);
+		if (c == NULL)
+			exit(1);
+		memcpy(c, b, mem);
+		kernel_select(&k, c, size, FORMAT_RGB, isa);
+
+		t = now();
+		for (int i = 0; i < rounds; i++)
+			k.blend_span(c, (size_t) size * size, 0x10203088);
+		report("fill", k.name, now() - t, (long) size * size * rounds);
+
+		if (memcmp(a, c, mem) != 0)
+			printf("ERROR: fill results differ for %s\n", k.name);
+		free(c);
+	}
+
+	free(a);
+	free(b);
+}
+
+int main(int argc, char **argv) {
+	unsigned int size = argc > 1 ? atoi(argv[1]) : 1024;
+	long writes = argc > 2 ? atol(argv[2]) : 50000000;
+
+	bench_set(size, writes);
+	bench_fill(size);
+	return 0;
+}
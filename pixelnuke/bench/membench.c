@@ -0,0 +1,109 @@
+// Random pixel writes into a canvas sized buffer, backed by normal pages
+// (malloc) vs. mem_alloc() (huge pages if available).
+// Reports throughput and data TLB misses (via perf_event_open, if permitted).
+//
+// Usage: ./membench [texsize] [writes] [numa-policy]
+
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "mem.h"
+
+static int perf_open_dtlb() {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_WRITE << 8)
+			| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fd < 0) {
+		// Some CPUs only count load misses
+		attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+				| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+	return fd;
+}
+
+static void bench(const char *name, uint8_t *data, unsigned int size, long writes) {
+	uint64_t misses = 0;
+	uint32_t seed = 2463534242u;
+	struct timespec t1, t2;
+
+	// Fault in all pages first, we want to measure steady state.
+	memset(data, 0, (size_t) size * size * 3);
+
+	int fd = perf_open_dtlb();
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	for (long i = 0; i < writes; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		unsigned int x = seed % size, y = (seed >> 16) % size;
+		uint8_t *ptr = data + ((size_t) y * size + x) * 3;
+		ptr[0] = i;
+		ptr[1] = i >> 8;
+		ptr[2] = i >> 16;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+			misses = 0;
+		close(fd);
+	}
+
+	double sec = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+	printf("%-10s %8.1f Mpx/s  %6.2f ns/px  ", name, writes / sec / 1e6,
+			sec * 1e9 / writes);
+	if (fd >= 0)
+		printf("dTLB misses: %.3f/px\n", (double) misses / writes);
+	else
+		printf("dTLB misses: n/a (perf_event_open not permitted)\n");
+}
+
+int main(int argc, char **argv) {
+	unsigned int size = argc > 1 ? atoi(argv[1]) : 4096;
+	long writes = argc > 2 ? atol(argv[2]) : 100000000;
+	size_t mem = (size_t) size * size * 3;
+
+	if (argc > 3 && mem_parse_numa(argv[3]) == -2) {
+		printf("Invalid NUMA policy: %s\n", argv[3]);
+		return 1;
+	}
+
+	uint8_t *normal = malloc(mem);
+	if (normal == NULL)
+		return 1;
+	// Make sure glibc does not get transparent huge pages by accident
+	madvise((void*) (((uintptr_t) normal + 4095) & ~(uintptr_t) 4095),
+			mem - 4096, MADV_NOHUGEPAGE);
+	bench("malloc", normal, size, writes);
+	free(normal);
+
+	uint8_t *huge = mem_alloc(mem);
+	if (huge == NULL)
+		return 1;
+	bench(mem_last_kind(), huge, size, writes);
+	mem_free(huge, mem);
+
+	return 0;
+}
@@ -1,12 +1,23 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
-#include <unistd.h> // usleep
+#include <time.h> // nanosleep
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h> //memcpy
 
 #include "canvas.h"
+#include "trace.h"
+#include "mem.h"
+#include "kernel.h"
+
+// Frames are finished this many seconds before the expected deadline, to
+// absorb scheduling jitter.
+#define CANVAS_PACING_MARGIN 0.002
+// Initial estimate for the time needed to upload and draw a frame (seconds)
+#define CANVAS_WORK_INITIAL 0.004
+// Used if the refresh rate of the display is unknown
+#define CANVAS_DEFAULT_FPS 60
 
 typedef struct CanvasLayer {
 	GLuint size;
@@ -16,8 +27,38 @@ typedef struct CanvasLayer {
 	GLuint pbo2;
 	GLubyte *data;
 	size_t mem;
+	int dirty; // Only tracked for the overlay
+	Kernels kernels; // Specialized for this format and size
 } CanvasLayer;
 
+// Fullscreen triangle, no vertex buffers needed.
+static const char *canvas_vertex_src = "#version 330 core\n"
+		"void main() {\n"
+		"	vec2 pos = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+		"	gl_Position = vec4(pos * 2.0 - 1.0, 0.0, 1.0);\n"
+		"}\n";
+
+// view.x is the framebuffer height, view.y the size of the (square) canvas
+// on screen. The canvas is anchored in the top left corner.
+static const char *canvas_fragment_src = "#version 330 core\n"
+		"uniform sampler2D base;\n"
+		"uniform sampler2D overlay;\n"
+		"uniform int use_overlay;\n"
+		"uniform vec2 view;\n"
+		"out vec4 color;\n"
+		"void main() {\n"
+		"	vec2 pos = vec2(gl_FragCoord.x, view.x - gl_FragCoord.y) / view.y;\n"
+		"	if (pos.x > 1.0 || pos.y > 1.0) {\n"
+		"		color = vec4(0.0, 0.0, 0.0, 1.0);\n"
+		"		return;\n"
+		"	}\n"
+		"	color = vec4(texture(base, pos).rgb, 1.0);\n"
+		"	if (use_overlay != 0) {\n"
+		"		vec4 o = texture(overlay, pos);\n"
+		"		color.rgb = mix(color.rgb, o.rgb, o.a);\n"
+		"	}\n"
+		"}\n";
+
 // Global state
 
 static int canvas_display = -1;
@@ -28,6 +69,15 @@ static GLFWwindow* canvas_win;
 static CanvasLayer *canvas_base;
 static CanvasLayer *canvas_overlay;
 
+static GLuint canvas_program;
+static GLuint canvas_vao;
+static GLint canvas_view_loc;
+static GLint canvas_use_overlay_loc;
+static int canvas_use_overlay = 0;
+static int canvas_linear = 1;
+static unsigned int canvas_fps = 0;
+static CanvasStats canvas_stats;
+
 pthread_t canvas_thread;
 
 void glfw_error_callback(int error, const char* description) {
@@ -49,24 +99,40 @@ void (*canvas_on_resize_cb)();
 void (*canvas_on_key_cb)(int, int, int);
 
 static int canvas_do_layout = 0;
+static int canvas_do_view = 1;
 
 static CanvasLayer* canvas_layer_alloc(int size, int alpha) {
 	CanvasLayer * layer = malloc(sizeof(CanvasLayer));
 	layer->size = size;
 	layer->format = alpha ? GL_RGBA : GL_RGB;
 	layer->mem = size * size * (alpha ? 4 : 3);
-	layer->data = malloc(sizeof(GLubyte) * layer->mem);
-	memset(layer->data, 0, layer->mem);
+	// Zeroed, and backed by huge pages if possible to reduce TLB misses on random writes.
+	layer->data = mem_alloc(sizeof(GLubyte) * layer->mem);
+	if (layer->data == NULL) {
+		puts("Failed to allocate canvas memory");
+		exit(1);
+	}
+	layer->tex = 0;
+	layer->dirty = 0;
+	kernel_select(&layer->kernels, layer->data, size, alpha ? 4 : 3, KERNEL_ISA_BEST);
+	printf("Canvas layer: %ux%u, %zu bytes (%s pages, %s kernels)\n", size, size,
+			layer->mem, mem_last_kind(), layer->kernels.name);
 	return layer;
 }
 
 static void canvas_layer_bind(CanvasLayer* layer) {
 
-	// Create texture object
+	GLint filter = canvas_linear ? GL_LINEAR : GL_NEAREST;
+
+	// Create texture object. Storage is allocated once, frames only update it.
 	glGenTextures(1, &(layer->tex));
 	glBindTexture( GL_TEXTURE_2D, layer->tex);
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D( GL_TEXTURE_2D, 0, layer->format, layer->size, layer->size, 0,
+			layer->format, GL_UNSIGNED_BYTE, NULL);
 	glBindTexture( GL_TEXTURE_2D, 0);
 
 	// Create two PBOs
@@ -85,12 +151,13 @@ static void canvas_layer_unbind(CanvasLayer * layer) {
 		glDeleteTextures(1, &(layer->tex));
 		glDeleteBuffers(1, &(layer->pbo1));
 		glDeleteBuffers(1, &(layer->pbo2));
+		layer->tex = 0;
 	}
 }
 
 static void canvas_layer_free(CanvasLayer * layer) {
 	canvas_layer_unbind(layer);
-	free(layer->data);
+	mem_free(layer->data, layer->mem);
 	free(layer);
 }
 
@@ -107,6 +174,7 @@ static void canvas_on_key(GLFWwindow* window, int key, int scancode, int action,
 static void canvas_on_resize(GLFWwindow* window, int w, int h) {
 	canvas_width = w;
 	canvas_height = h;
+	canvas_do_view = 1;
 
 	if(canvas_on_resize_cb)
 		(*canvas_on_resize_cb)();
@@ -119,6 +187,10 @@ static void canvas_window_setup() {
 	}
 
 	glfwWindowHint(GLFW_DOUBLEBUFFER, 1);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, 1);
 	if (canvas_display >= 0) {
 		int mcount;
 		GLFWmonitor** monitors = glfwGetMonitors(&mcount);
@@ -141,16 +213,11 @@ static void canvas_window_setup() {
 
 	glfwMakeContextCurrent(canvas_win);
 
-	// TODO: Move GL stuff to better place
-	//glShadeModel(GL_FLAT);            // shading mathod: GL_SMOOTH or GL_FLAT
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 4); // 4-byte pixel alignment
-	//glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
-	//glHint(GL_LINE_SMOOTH_HINT, GL_NICEST);
-	//glHint(GL_POLYGON_SMOOTH_HINT, GL_NICEST);
+	// RGB rows are not necessarily a multiple of 4 bytes long
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_LIGHTING);
 	glDisable(GL_CULL_FACE);
-	glEnable(GL_TEXTURE_2D);
+	glDisable(GL_BLEND);
 
 	//glfwSetWindowUserPointer(canvas_win, (void*) this);
 	glfwSwapInterval(1);
@@ -161,56 +228,165 @@ static void canvas_window_setup() {
 	canvas_on_resize(canvas_win, canvas_width, canvas_height);
 
 	canvas_do_layout = 0;
+	canvas_do_view = 1;
 }
 
-static void canvas_draw_layer(CanvasLayer * layer) {
-	if (!layer || !layer->data)
-		return;
+static GLuint canvas_compile(GLenum type, const char *src) {
+	GLint ok;
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &src, NULL);
+	glCompileShader(shader);
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+	if (!ok) {
+		char log[1024];
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		printf("Shader compilation failed: %s\n", log);
+		glDeleteShader(shader);
+		return 0;
+	}
+	return shader;
+}
 
-	GLuint pboNext = layer->pbo1;
-	GLuint pboIndex = layer->pbo2;
-	layer->pbo1 = pboIndex;
-	layer->pbo2 = pboNext;
+// Create the presenter program for the current context. Return 0 on success.
+static int canvas_program_setup() {
+	GLint ok;
+	GLuint vs = canvas_compile(GL_VERTEX_SHADER, canvas_vertex_src);
+	GLuint fs = canvas_compile(GL_FRAGMENT_SHADER, canvas_fragment_src);
+	if (!vs || !fs)
+		return -1;
+
+	canvas_program = glCreateProgram();
+	glAttachShader(canvas_program, vs);
+	glAttachShader(canvas_program, fs);
+	glLinkProgram(canvas_program);
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+	glGetProgramiv(canvas_program, GL_LINK_STATUS, &ok);
+	if (!ok) {
+		char log[1024];
+		glGetProgramInfoLog(canvas_program, sizeof(log), NULL, log);
+		printf("Shader linking failed: %s\n", log);
+		return -1;
+	}
 
-	// Switch PBOs on each call. One is updated, one is drawn.
-	// Update texture from first PBO
-	glBindBuffer( GL_PIXEL_UNPACK_BUFFER, pboIndex);
-	glBindTexture( GL_TEXTURE_2D, layer->tex);
-	glTexImage2D( GL_TEXTURE_2D, 0, layer->format, layer->size, layer->size, 0,
-			layer->format, GL_UNSIGNED_BYTE, 0);
-	glBindTexture( GL_TEXTURE_2D, 0);
+	glUseProgram(canvas_program);
+	glUniform1i(glGetUniformLocation(canvas_program, "base"), 0);
+	glUniform1i(glGetUniformLocation(canvas_program, "overlay"), 1);
+	canvas_view_loc = glGetUniformLocation(canvas_program, "view");
+	canvas_use_overlay_loc = glGetUniformLocation(canvas_program, "use_overlay");
+	glUniform1i(canvas_use_overlay_loc, canvas_use_overlay);
+
+	// Core profile needs a vertex array object, even if it is empty.
+	glGenVertexArrays(1, &canvas_vao);
+	glBindVertexArray(canvas_vao);
+	return 0;
+}
+
+static void canvas_program_free() {
+	if (canvas_program) {
+		glDeleteVertexArrays(1, &canvas_vao);
+		glDeleteProgram(canvas_program);
+		canvas_program = 0;
+	}
+}
+
+// Refresh rate of the display the window is on, or the configured target.
+static double canvas_frame_period() {
+	if (canvas_fps)
+		return 1.0 / canvas_fps;
+
+	GLFWmonitor* monitor = glfwGetWindowMonitor(canvas_win);
+	if (!monitor)
+		monitor = glfwGetPrimaryMonitor();
+	const GLFWvidmode* mode = monitor ? glfwGetVideoMode(monitor) : NULL;
+	if (mode && mode->refreshRate > 0)
+		return 1.0 / mode->refreshRate;
+	return 1.0 / CANVAS_DEFAULT_FPS;
+}
+
+static void canvas_sleep_until(double t) {
+	double sleep = t - glfwGetTime();
+	if (sleep <= 0)
+		return;
+	struct timespec ts = { (time_t) sleep, (long) ((sleep - (time_t) sleep) * 1e9) };
+	nanosleep(&ts, NULL);
+}
+
+// Copy the layer into a PBO and from there into its texture. The texture
+// update is queued on the GPU and visible in the frame drawn next.
+static void canvas_layer_upload(CanvasLayer * layer) {
+	if (!layer || !layer->data)
+		return;
 
-	// Update second PBO with new pixel data
-	glBindBuffer( GL_PIXEL_UNPACK_BUFFER, pboNext);
-	GLubyte *ptr = (GLubyte*) glMapBuffer( GL_PIXEL_UNPACK_BUFFER,
-			GL_WRITE_ONLY);
-	memcpy(ptr, layer->data, layer->mem);
-	glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER);
+	// Alternate between PBOs, so we never map a buffer the GPU still reads from.
+	GLuint pbo = layer->pbo1;
+	layer->pbo1 = layer->pbo2;
+	layer->pbo2 = pbo;
+
+	glBindBuffer( GL_PIXEL_UNPACK_BUFFER, pbo);
+	GLubyte *ptr = (GLubyte*) glMapBufferRange( GL_PIXEL_UNPACK_BUFFER, 0,
+			layer->mem, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (ptr) {
+		uint64_t t_upload = trace_now();
+		if (layer == canvas_base)
+			trace_frame_staged();
+		memcpy(ptr, layer->data, layer->mem);
+		if (layer == canvas_base)
+			trace_record(TRACE_UPLOAD, trace_now() - t_upload);
+		glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER);
+
+		glBindTexture( GL_TEXTURE_2D, layer->tex);
+		glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, layer->size, layer->size,
+				layer->format, GL_UNSIGNED_BYTE, 0);
+		glBindTexture( GL_TEXTURE_2D, 0);
+	}
 	glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0);
+	TRACE_PROBE1(canvas_upload, layer->mem);
+}
 
-	//// Actually draw stuff. The texture should be updated in the meantime.
+static void canvas_draw() {
+	if (canvas_do_view) {
+		glfwGetFramebufferSize(canvas_win, &canvas_width, &canvas_height);
+		glViewport(0, 0, (GLsizei) canvas_width, (GLsizei) canvas_height);
 
-	if (layer->format == GL_RGBA) {
-		glEnable( GL_BLEND);
-		glBlendFunc( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	} else {
-		glDisable( GL_BLEND);
+		float size = canvas_base->size;
+		if (canvas_width > size || canvas_height > size)
+			size = max(canvas_width, canvas_height);
+		glUniform2f(canvas_view_loc, canvas_height, size);
+		canvas_do_view = 0;
 	}
 
-	glPushMatrix();
-	glBindTexture( GL_TEXTURE_2D, layer->tex);
-	glBegin( GL_QUADS);
-	glTexCoord2f(0, 0);
-	glVertex3f(0.0f, 0.0f, 0.0f);
-	glTexCoord2f(0, 1);
-	glVertex3f(0.0f, layer->size, 0.0f);
-	glTexCoord2f(1, 1);
-	glVertex3f(layer->size, layer->size, 0.0f);
-	glTexCoord2f(1, 0);
-	glVertex3f(layer->size, 0.0f, 0.0f);
-	glEnd();
-	glBindTexture( GL_TEXTURE_2D, 0);
-	glPopMatrix();
+	canvas_layer_upload(canvas_base);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, canvas_base->tex);
+
+	// The overlay is only composited once something was drawn on it, and
+	// only uploaded if it changed since.
+	int use_overlay = __atomic_load_n(&canvas_use_overlay, __ATOMIC_RELAXED);
+	if (use_overlay) {
+		if (__atomic_exchange_n(&canvas_overlay->dirty, 0, __ATOMIC_RELAXED))
+			canvas_layer_upload(canvas_overlay);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, canvas_overlay->tex);
+		glActiveTexture(GL_TEXTURE0);
+	}
+	glUniform1i(canvas_use_overlay_loc, use_overlay);
+
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+static int canvas_gl_setup() {
+	canvas_layer_bind(canvas_base);
+	canvas_layer_bind(canvas_overlay);
+	// Everything was uploaded to the old context only
+	canvas_overlay->dirty = 1;
+	return canvas_program_setup();
+}
+
+static void canvas_gl_free() {
+	canvas_program_free();
+	canvas_layer_unbind(canvas_base);
+	canvas_layer_unbind(canvas_overlay);
 }
 
 static void* canvas_render_loop(void * arg) {
@@ -226,6 +402,8 @@ static void* canvas_render_loop(void * arg) {
 
 	canvas_window_setup();
 
+	// Needed for core profile contexts
+	glewExperimental = GL_TRUE;
 	int err = glewInit();
 	if (err != GLEW_OK) {
 		puts("GLEW initialization failed");
@@ -234,60 +412,72 @@ static void* canvas_render_loop(void * arg) {
 			(*canvas_on_close_cb)();
 		return NULL;
 	}
+	// glewInit() triggers a harmless GL_INVALID_ENUM on core profiles.
+	glGetError();
 
-	canvas_layer_bind(canvas_base);
-	canvas_layer_bind(canvas_overlay);
+	if (canvas_gl_setup() != 0) {
+		if(canvas_on_close_cb)
+			(*canvas_on_close_cb)();
+		return NULL;
+	}
 
-	double last_frame = glfwGetTime();
+	// Frame pacing: Sleep until just before the next frame is due, then poll
+	// events, upload and draw as late as possible, so a frame shows pixels
+	// that are as fresh as possible. The time needed for that is estimated
+	// from previous frames (fast attack, slow decay).
+	double work = CANVAS_WORK_INITIAL;
+	double last_swap = glfwGetTime();
+	uint64_t last_swap_ticks = trace_now();
 
 	while ("pixels are coming") {
 
 		if (canvas_do_layout) {
-			canvas_layer_unbind(canvas_base);
-			canvas_layer_unbind(canvas_overlay);
+			canvas_gl_free();
 			canvas_window_setup();
-			canvas_layer_bind(canvas_base);
-			canvas_layer_bind(canvas_overlay);
+			if (canvas_gl_setup() != 0)
+				break;
 		}
 
 		if (glfwWindowShouldClose(canvas_win))
 			break;
 
-		glfwGetFramebufferSize(canvas_win, &canvas_width, &canvas_height);
-		glMatrixMode(GL_PROJECTION);
-		glLoadIdentity();
-		glOrtho(0, canvas_width, canvas_height, 0, -1, 1);
-		glViewport(0, 0, (GLsizei) canvas_width, (GLsizei) canvas_height);
-		glClearColor(0, 0, 0, 1);
-		glClear(GL_COLOR_BUFFER_BIT);
-		glPushMatrix();
-
-		GLuint texSize = canvas_base->size;
-		if(canvas_width > texSize || canvas_height > texSize) {
-		    float scale = ((float) max(canvas_width, canvas_height)) / (float) texSize;
-		    glScalef(scale, scale, 1);
-		}
-
-		canvas_draw_layer(canvas_base);
-		// TODO: Overlay is not used yet
-		//canvas_draw_layer(canvas_overlay);
+		double period = canvas_frame_period();
+		canvas_sleep_until(last_swap + period - work - CANVAS_PACING_MARGIN);
 
-		glPopMatrix();
+		double start = glfwGetTime();
 		glfwPollEvents();
+		canvas_draw();
+		// Wait for the GPU, so the measured time includes the upload and
+		// draw, not just queuing the commands.
+		glFinish();
+		double done = glfwGetTime();
+
 		glfwSwapBuffers(canvas_win);
+		trace_frame_shown();
+		TRACE_PROBE(canvas_frame);
 
 		double now = glfwGetTime();
-		double dt = now - last_frame;
-		last_frame = now;
-		double sleep = 1.0 / 30 - dt;
-		if (sleep > 0) {
-			usleep(sleep * 1000000);
-		}
+		uint64_t now_ticks = trace_now();
+		trace_record(TRACE_FRAME, now_ticks - last_swap_ticks);
+
+		double frame = now - last_swap;
+		__atomic_add_fetch(&canvas_stats.frames, 1, __ATOMIC_RELAXED);
+		if (frame > period * 1.5)
+			__atomic_add_fetch(&canvas_stats.missed, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&canvas_stats.frame_us, (unsigned int) (frame * 1e6), __ATOMIC_RELAXED);
+		__atomic_store_n(&canvas_stats.work_us, (unsigned int) ((done - start) * 1e6), __ATOMIC_RELAXED);
+
+		work = done - start > work ? done - start : work * 0.95 + (done - start) * 0.05;
+		if (work > period)
+			work = period;
+		last_swap = now;
+		last_swap_ticks = now_ticks;
 	}
 
 	if(canvas_on_close_cb)
 		(*canvas_on_close_cb)();
 
+	canvas_gl_free();
 	glfwTerminate();
 	canvas_layer_free(canvas_base);
 	canvas_layer_free(canvas_overlay);
@@ -312,6 +502,21 @@ void canvas_start(unsigned int texSize, void (*on_close)()) {
 	}
 }
 
+void canvas_set_fps(unsigned int fps) {
+	canvas_fps = fps;
+}
+
+void canvas_set_filter(int linear) {
+	canvas_linear = linear;
+}
+
+void canvas_get_stats(CanvasStats *stats) {
+	stats->frames = __atomic_load_n(&canvas_stats.frames, __ATOMIC_RELAXED);
+	stats->missed = __atomic_load_n(&canvas_stats.missed, __ATOMIC_RELAXED);
+	stats->frame_us = __atomic_load_n(&canvas_stats.frame_us, __ATOMIC_RELAXED);
+	stats->work_us = __atomic_load_n(&canvas_stats.work_us, __ATOMIC_RELAXED);
+}
+
 void canvas_setcb_key(void (*on_key)(int key, int scancode, int mods)) {
 	canvas_on_key_cb = on_key;
 }
@@ -333,65 +538,31 @@ int canvas_get_display() {
 	return canvas_display;
 }
 
-// Return a pointer to the GLubyte for a given pixel, or NULL for out of bound coordinates.
-static inline GLubyte* canvas_offset(CanvasLayer * layer, unsigned int x,
-		unsigned int y) {
-	if (x < 0 || y < 0 || x >= layer->size || y >= layer->size || layer->data == NULL)
-		return NULL;
-	return layer->data
-			+ ((y * layer->size) + x) * (layer->format == GL_RGBA ? 4 : 3);
+const Kernels* canvas_get_kernels() {
+	return &canvas_base->kernels;
 }
 
 void canvas_set_px(unsigned int x, unsigned int y, uint32_t rgba) {
-	CanvasLayer * layer = canvas_base;
-	GLubyte* ptr = canvas_offset(layer, x, y);
-
-	if (ptr == NULL) {
-		return;
-	}
-
-	GLubyte r = (rgba & 0xff000000) >> 24;
-	GLubyte g = (rgba & 0x00ff0000) >> 16;
-	GLubyte b = (rgba & 0x0000ff00) >> 8;
-	GLubyte a = (rgba & 0x000000ff) >> 0;
+	Kernels *k = &canvas_base->kernels;
+	TRACE_PROBE3(canvas_set_px, x, y, rgba);
+	k->blend(&k->layer, x, y, rgba);
+}
 
-	if (layer->format == GL_RGBA) {
-		ptr[0] = r;
-		ptr[1] = g;
-		ptr[2] = b;
-		ptr[3] = a;
-		return;
-	}
-	if (a == 0) {
-		return;
-	}
-	if (a < 0xff) {
-		GLuint na = 0xff - a;
-		r = (a * r + na * (ptr[0])) / 0xff;
-		g = (a * g + na * (ptr[1])) / 0xff;
-		b = (a * b + na * (ptr[2])) / 0xff;
-	}
-	ptr[0] = r;
-	ptr[1] = g;
-	ptr[2] = b;
+void canvas_set_overlay_px(unsigned int x, unsigned int y, uint32_t rgba) {
+	Kernels *k = &canvas_overlay->kernels;
+	k->set(&k->layer, x, y, rgba);
+	__atomic_store_n(&canvas_overlay->dirty, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&canvas_use_overlay, 1, __ATOMIC_RELAXED);
 }
 
 void canvas_fill(uint32_t rgba) {
 	CanvasLayer * layer = canvas_base;
-	for(int x=0; x<layer->size; x++)
-		for(int y=0; y<layer->size; y++)
-			canvas_set_px(x, y, rgba);
+	layer->kernels.blend_span(layer->data, (size_t) layer->size * layer->size, rgba);
 }
 
-
 void canvas_get_px(unsigned int x, unsigned int y, uint32_t *rgba) {
-	CanvasLayer * layer = canvas_base;
-	GLubyte* ptr = canvas_offset(layer, x, y);
-	if (ptr == NULL) {
-		*rgba = 0x000000;
-	} else {
-		*rgba = (ptr[0] << 24) + (ptr[1] << 16) + (ptr[2] << 8) + 0xff;
-	}
+	Kernels *k = &canvas_base->kernels;
+	*rgba = k->get(&k->layer, x, y);
 }
 
 void canvas_get_size(unsigned int *w, unsigned int *h) {
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 
+#include "kernel.h"
+
 // Open the canvas window and start the gui loop (in a separate thread)
 void canvas_start(unsigned int texSize, void (*on_close)());
 
@@ -12,13 +14,38 @@ void canvas_setcb_resize(void (*on_resize)());
 // Close the canvas window and free any resources and contexts
 void canvas_close();
 
+// Target frame rate. 0 (default) follows the refresh rate of the display.
+// Rates above the refresh rate are capped by vsync.
+void canvas_set_fps(unsigned int fps);
+
+// Scale the canvas with linear (1, default) or nearest neighbour (0) filtering.
+// Must be called before canvas_start().
+void canvas_set_filter(int linear);
+
+typedef struct CanvasStats {
+	unsigned int frames;   // Frames shown so far
+	unsigned int missed;   // Frames that took more than 1.5 frame periods
+	unsigned int frame_us; // Duration of the last frame
+	unsigned int work_us;  // Time spent polling, uploading and drawing the last frame
+} CanvasStats;
+
+void canvas_get_stats(CanvasStats *stats);
+
 void canvas_fullscreen(int display);
 int canvas_get_display();
 
+// Pixel kernels of the canvas, selected by canvas_start(). Hot paths can
+// call these directly instead of going through canvas_set_px().
+const Kernels* canvas_get_kernels();
+
 void canvas_fill(uint32_t rgba);
 void canvas_set_px(unsigned int x, unsigned int y, uint32_t rgba);
 void canvas_get_px(unsigned int x, unsigned int y, uint32_t *rgba);
 
+// Draw on the RGBA overlay, which is blended over the canvas. The overlay is
+// only composited (and uploaded) once it was drawn on.
+void canvas_set_overlay_px(unsigned int x, unsigned int y, uint32_t rgba);
+
 // get the current visible canvas size in pixel.
 // The actual window might be bigger if scaling is enabled.
 void canvas_get_size(unsigned int *width, unsigned int *height);
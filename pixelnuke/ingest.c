@@ -0,0 +1,263 @@
+#define _GNU_SOURCE // memfd_create
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+
+#include <event2/event.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#include "ingest.h"
+#include "net.h"
+
+// Drain at most this many bytes per ring before checking the network clients
+// again, so a single producer cannot starve them. Compare NET_MAX_BUFFER.
+#define INGEST_BUDGET (256 * 1024)
+
+typedef struct IngestConn {
+	int sock_fd;
+	IngestRing *ring;
+	size_t map_len;
+	uint64_t tail; // Our copy, the shared one is only written.
+	struct event *ev;
+	struct IngestConn *next;
+} IngestConn;
+
+// Global state
+
+static struct event_base *base;
+static struct event *ingest_listener;
+static struct event *ingest_event;
+static char *ingest_path;
+static IngestConn *ingest_conns;
+static unsigned int ingest_conncount;
+
+static ingest_on_pixels ingestcb_on_pixels;
+static ingest_on_rect ingestcb_on_rect;
+
+// Helper functions
+
+static void ingest_free(IngestConn *conn) {
+	IngestConn **it = &ingest_conns;
+	while (*it != conn)
+		it = &(*it)->next;
+	*it = conn->next;
+
+	event_free(conn->ev);
+	munmap(conn->ring, conn->map_len);
+	close(conn->sock_fd);
+	free(conn);
+
+	if (--ingest_conncount == 0)
+		evtimer_del(ingest_event);
+}
+
+// Run ingestev_on_drain as soon as the event loop checked for network input.
+static void ingest_schedule() {
+	struct timeval now = { 0, 0 };
+	evtimer_add(ingest_event, &now);
+}
+
+// Process up to `budget` bytes of records. Return -1 if the ring is corrupt,
+// 1 if there is more to do and 0 if the ring is empty and waits for a wake-up.
+static int ingest_drain(IngestConn *conn, size_t budget) {
+	IngestRing *ring = conn->ring;
+	uint32_t size = INGEST_RING_SIZE;
+	uint64_t tail = conn->tail;
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	size_t done = 0;
+
+	if (head - tail > size)
+		return -1;
+
+	while (tail != head && done < budget) {
+		uint32_t off = tail & (size - 1);
+		IngestRecord rec = *(IngestRecord*) (ring->data + off);
+
+		// The producer is trusted with the content, not with the framing.
+		if (rec.len < sizeof(IngestRecord) || rec.len & 7
+				|| rec.len > head - tail || off + rec.len > size)
+			return -1;
+
+		void *payload = ring->data + off + sizeof(IngestRecord);
+		size_t payload_len = rec.len - sizeof(IngestRecord);
+
+		if (rec.type == INGEST_PIXELS) {
+			(*ingestcb_on_pixels)(payload, payload_len / sizeof(IngestPixel));
+		} else if (rec.type == INGEST_RECT) {
+			IngestRect rect = *(IngestRect*) payload;
+			if (payload_len < sizeof(IngestRect) + (size_t) rect.w * rect.h * 4)
+				return -1;
+			(*ingestcb_on_rect)(rect.x, rect.y, rect.w, rect.h,
+					(uint32_t*) ((IngestRect*) payload + 1));
+		} else if (rec.type != INGEST_PAD) {
+			return -1;
+		}
+
+		tail += rec.len;
+		done += rec.len;
+	}
+
+	conn->tail = tail;
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	if (tail != head)
+		return 1;
+
+	// Ask for a wake-up, unless something was published in the meantime.
+	__atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != tail;
+}
+
+// libevent callbacks
+
+// Drain all rings with data. Rings that are not empty after their budget was
+// used up are drained again in the next event loop iteration.
+static void ingestev_on_drain(evutil_socket_t fd, short event, void *arg) {
+	IngestConn *conn = ingest_conns;
+	int more = 0;
+	while (conn) {
+		IngestConn *next = conn->next;
+		int r = ingest_drain(conn, INGEST_BUDGET);
+		if (r < 0) {
+			printf("Ingest: Producer sent invalid data, disconnecting\n");
+			ingest_free(conn);
+		}
+		more |= r > 0;
+		conn = next;
+	}
+	if (more)
+		ingest_schedule();
+}
+
+// The socket is used for wake-ups and to detect disconnects.
+static void ingestev_on_read(evutil_socket_t fd, short event, void *arg) {
+	IngestConn *conn = arg;
+	char buf[64];
+	ssize_t r = recv(fd, buf, sizeof(buf), 0);
+	if (r > 0) {
+		ingest_schedule();
+	} else if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+		// Apply whatever is still in the ring.
+		ingest_drain(conn, (size_t) -1);
+		ingest_free(conn);
+	}
+}
+
+static void ingestev_on_accept(evutil_socket_t listener, short event, void *arg) {
+	int fd = accept(listener, NULL, NULL);
+	if (fd < 0) {
+		perror("ingest accept failed");
+		return;
+	}
+
+	IngestConn *conn = calloc(1, sizeof(IngestConn));
+	size_t map_len = sizeof(IngestRing) + INGEST_RING_SIZE;
+	int mem_fd = memfd_create("pixelnuke-ingest", MFD_CLOEXEC);
+
+	if (conn == NULL || mem_fd < 0 || ftruncate(mem_fd, map_len) < 0
+			|| (conn->ring = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+					MAP_SHARED, mem_fd, 0)) == MAP_FAILED) {
+		perror("ingest ring setup failed");
+		if (mem_fd >= 0)
+			close(mem_fd);
+		free(conn);
+		close(fd);
+		return;
+	}
+
+	conn->map_len = map_len;
+	conn->ring->magic = INGEST_MAGIC;
+	conn->ring->size = INGEST_RING_SIZE;
+	conn->ring->waiting = 1;
+
+	// Hand the segment to the producer
+	char byte = 0;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { &byte, 1 };
+	struct msghdr msg = { 0 };
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &mem_fd, sizeof(int));
+
+	int sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	close(mem_fd);
+	if (sent != 1) {
+		munmap(conn->ring, conn->map_len);
+		free(conn);
+		close(fd);
+		return;
+	}
+
+	evutil_make_socket_nonblocking(fd);
+	conn->sock_fd = fd;
+	conn->ev = event_new(base, fd, EV_READ | EV_PERSIST, ingestev_on_read, conn);
+	event_add(conn->ev, NULL);
+
+	conn->next = ingest_conns;
+	ingest_conns = conn;
+	ingest_conncount++;
+}
+
+// Public functions
+
+void ingest_start(const char *path, ingest_on_pixels on_pixels, ingest_on_rect on_rect) {
+	struct sockaddr_un addr;
+
+	base = net_base();
+	ingestcb_on_pixels = on_pixels;
+	ingestcb_on_rect = on_rect;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		errx(1, "Ingest socket path too long: %s", path);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0)
+		err(1, "ingest socket failed");
+	if (bind(listener, (struct sockaddr*) &addr, sizeof(addr)) < 0)
+		err(1, "ingest bind failed");
+	if (listen(listener, 16) < 0)
+		err(1, "ingest listen failed");
+	evutil_make_socket_nonblocking(listener);
+
+	ingest_path = strdup(path);
+	ingest_listener = event_new(base, listener, EV_READ | EV_PERSIST,
+			ingestev_on_accept, NULL);
+	event_add(ingest_listener, NULL);
+	ingest_event = evtimer_new(base, ingestev_on_drain, NULL);
+}
+
+void ingest_stop() {
+	if (!ingest_listener)
+		return;
+
+	while (ingest_conns)
+		ingest_free(ingest_conns);
+
+	close(event_get_fd(ingest_listener));
+	event_free(ingest_listener);
+	event_free(ingest_event);
+	ingest_listener = NULL;
+
+	unlink(ingest_path);
+	free(ingest_path);
+}
+
+unsigned int ingest_count() {
+	return ingest_conncount;
+}
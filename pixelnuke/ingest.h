@@ -0,0 +1,194 @@
+#ifndef INGEST_H_
+#define INGEST_H_
+
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+
+// Local ingest channel for producers running on the same host.
+//
+// A producer connects to the unix domain socket of the server and receives a
+// file descriptor of a shared memory segment, which contains a single
+// producer / single consumer ring of pixel records. The producer appends
+// records and advances `head`, the server drains them in its event loop and
+// advances `tail`. The ring stays valid as long as the socket is connected.
+//
+// While the server has nothing to do, it sets `waiting`. A producer that
+// publishes a record clears it and sends a single byte over the socket to wake
+// the server up. The server keeps draining without further wake-ups as long as
+// the ring is not empty.
+//
+// This header contains both the server API and a small header-only producer API.
+
+#define INGEST_MAGIC 0x50584e32 // "PXN2"
+#define INGEST_RING_SIZE (4 * 1024 * 1024) // bytes, power of two
+
+// Record types
+#define INGEST_PAD 0    // Skip to the end of the ring
+#define INGEST_PIXELS 1 // A batch of IngestPixel
+#define INGEST_RECT 2   // IngestRect header, followed by w*h RGBA values (row-major)
+
+// Records are 8-byte aligned and never wrap around the end of the ring.
+typedef struct IngestRecord {
+	uint32_t type;
+	uint32_t len; // Total length in bytes, including this header
+} IngestRecord;
+
+typedef struct IngestPixel {
+	uint16_t x;
+	uint16_t y;
+	uint32_t rgba; // Same format as canvas_set_px()
+} IngestPixel;
+
+typedef struct IngestRect {
+	uint16_t x;
+	uint16_t y;
+	uint16_t w;
+	uint16_t h;
+} IngestRect;
+
+typedef struct IngestRing {
+	uint32_t magic;
+	uint32_t size; // Size of data[] in bytes
+	// Positions are byte counters that only grow, offsets are pos & (size - 1)
+	uint64_t head __attribute__((aligned(64))); // Written by the producer
+	uint64_t tail __attribute__((aligned(64))); // Written by the server
+	uint32_t waiting __attribute__((aligned(64))); // Set by the server, cleared by the producer
+	uint8_t data[] __attribute__((aligned(64)));
+} IngestRing;
+
+// Server API
+
+// Called for each batch of pixels / each rectangle drained from a ring.
+typedef void (*ingest_on_pixels)(const IngestPixel *px, unsigned int count);
+typedef void (*ingest_on_rect)(unsigned int x, unsigned int y, unsigned int w,
+		unsigned int h, const uint32_t *rgba);
+
+// Listen on a unix domain socket and drain all rings from within the net_base() event loop.
+void ingest_start(const char *path, ingest_on_pixels on_pixels, ingest_on_rect on_rect);
+// Remove the socket file and disconnect all producers.
+void ingest_stop();
+// Number of connected producers
+unsigned int ingest_count();
+
+// Producer API
+
+typedef struct IngestProducer {
+	int sock;
+	IngestRing *ring;
+	size_t map_len;
+	uint64_t head;
+} IngestProducer;
+
+// Connect to a server and map its ring. Return 0 on success.
+static inline int ingest_connect(IngestProducer *p, const char *path) {
+	struct sockaddr_un addr;
+	char byte;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { &byte, 1 };
+	struct msghdr msg = { 0 };
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	memset(addr.sun_path, 0, sizeof(addr.sun_path));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	if ((p->sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (connect(p->sock, (struct sockaddr*) &addr, sizeof(addr)) < 0
+			|| recvmsg(p->sock, &msg, 0) != 1 || !CMSG_FIRSTHDR(&msg)) {
+		close(p->sock);
+		return -1;
+	}
+
+	int fd;
+	memcpy(&fd, CMSG_DATA(CMSG_FIRSTHDR(&msg)), sizeof(int));
+	p->map_len = sizeof(IngestRing) + INGEST_RING_SIZE;
+	p->ring = mmap(NULL, p->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p->ring == MAP_FAILED || p->ring->magic != INGEST_MAGIC
+			|| p->ring->size != INGEST_RING_SIZE) {
+		close(p->sock);
+		return -1;
+	}
+	p->head = p->ring->head;
+	return 0;
+}
+
+static inline void ingest_disconnect(IngestProducer *p) {
+	munmap(p->ring, p->map_len);
+	close(p->sock);
+}
+
+// Reserve space for a record of len bytes (multiple of 8). Spins until the
+// server made enough room. Returns a pointer into the ring.
+static inline IngestRecord* ingest_reserve(IngestProducer *p, uint32_t len) {
+	IngestRing *ring = p->ring;
+	uint32_t off = p->head & (ring->size - 1);
+	uint32_t pad = off + len > ring->size ? ring->size - off : 0;
+
+	while (p->head + pad + len - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->size)
+		usleep(50);
+
+	if (pad) {
+		IngestRecord *rec = (IngestRecord*) (ring->data + off);
+		rec->type = INGEST_PAD;
+		rec->len = pad;
+		p->head += pad;
+		off = 0;
+	}
+	return (IngestRecord*) (ring->data + off);
+}
+
+// Publish a record returned by ingest_reserve() and wake the server if needed.
+static inline void ingest_commit(IngestProducer *p, IngestRecord *rec) {
+	p->head += rec->len;
+	// Sequentially consistent, so either we see `waiting` or the server sees the new head.
+	__atomic_store_n(&p->ring->head, p->head, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&p->ring->waiting, __ATOMIC_SEQ_CST)
+			&& __atomic_exchange_n(&p->ring->waiting, 0, __ATOMIC_SEQ_CST)) {
+		char byte = 0;
+		send(p->sock, &byte, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+}
+
+static inline void ingest_pixels(IngestProducer *p, const IngestPixel *px, unsigned int count) {
+	const unsigned int max = INGEST_RING_SIZE / 4 / sizeof(IngestPixel);
+	while (count) {
+		unsigned int n = count < max ? count : max;
+		IngestRecord *rec = ingest_reserve(p, sizeof(IngestRecord) + n * sizeof(IngestPixel));
+		rec->type = INGEST_PIXELS;
+		rec->len = sizeof(IngestRecord) + n * sizeof(IngestPixel);
+		memcpy(rec + 1, px, n * sizeof(IngestPixel));
+		ingest_commit(p, rec);
+		px += n;
+		count -= n;
+	}
+}
+
+// Draw a rectangle. w*h*4 must fit into a quarter of the ring.
+static inline int ingest_rect(IngestProducer *p, unsigned int x, unsigned int y,
+		unsigned int w, unsigned int h, const uint32_t *rgba) {
+	size_t len = (sizeof(IngestRecord) + sizeof(IngestRect) + (size_t) w * h * 4 + 7) & ~7;
+	if (len > INGEST_RING_SIZE / 4 || x > 0xffff || y > 0xffff || w > 0xffff || h > 0xffff)
+		return -1;
+	IngestRecord *rec = ingest_reserve(p, len);
+	IngestRect *rect = (IngestRect*) (rec + 1);
+	rec->type = INGEST_RECT;
+	rec->len = len;
+	rect->x = x;
+	rect->y = y;
+	rect->w = w;
+	rect->h = h;
+	memcpy(rect + 1, rgba, (size_t) w * h * 4);
+	ingest_commit(p, rec);
+	return 0;
+}
+
+#endif /* INGEST_H_ */
@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNEL_X86 1
+#endif
+
+// Helper functions
+
+// Exact x / 255 for x <= 255 * 255, without a division.
+static inline uint32_t kernel_div255(uint32_t x) {
+	return (x + 1 + (x >> 8)) >> 8;
+}
+
+// Bounds check and address calculation. Called with constant pow2 and bpp,
+// so each kernel below is compiled without branches on either.
+static inline __attribute__((always_inline)) uint8_t* kernel_ptr(
+		const KernelLayer *l, unsigned int x, unsigned int y, int pow2, int bpp) {
+	if (pow2) {
+		if ((x | y) >> l->shift)
+			return NULL;
+		return l->data + (((size_t) y << l->shift) + x) * bpp;
+	}
+	if (x >= l->size || y >= l->size)
+		return NULL;
+	return l->data + ((size_t) y * l->size + x) * bpp;
+}
+
+// Scalar kernels
+
+#define KERNEL_DEFINE(name, pow2)                                                \
+static void kernel_set_rgb_##name(const KernelLayer *l, unsigned int x,          \
+		unsigned int y, uint32_t rgba) {                                         \
+	uint8_t *p = kernel_ptr(l, x, y, pow2, 3);                                   \
+	if (p == NULL)                                                               \
+		return;                                                                  \
+	p[0] = rgba >> 24;                                                           \
+	p[1] = rgba >> 16;                                                           \
+	p[2] = rgba >> 8;                                                            \
+}                                                                                \
+                                                                                 \
+/* a == 0xff and a == 0 give exact results, so there is no need to branch. */   \
+static void kernel_blend_rgb_##name(const KernelLayer *l, unsigned int x,        \
+		unsigned int y, uint32_t rgba) {                                         \
+	uint8_t *p = kernel_ptr(l, x, y, pow2, 3);                                   \
+	if (p == NULL)                                                               \
+		return;                                                                  \
+	uint32_t a = rgba & 0xff, na = 0xff - a;                                     \
+	p[0] = kernel_div255(((rgba >> 24) & 0xff) * a + p[0] * na);                 \
+	p[1] = kernel_div255(((rgba >> 16) & 0xff) * a + p[1] * na);                 \
+	p[2] = kernel_div255(((rgba >> 8) & 0xff) * a + p[2] * na);                  \
+}                                                                                \
+                                                                                 \
+static uint32_t kernel_get_rgb_##name(const KernelLayer *l, unsigned int x,      \
+		unsigned int y) {                                                        \
+	uint8_t *p = kernel_ptr(l, x, y, pow2, 3);                                   \
+	if (p == NULL)                                                               \
+		return 0;                                                                \
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | 0xff;                     \
+}                                                                                \
+                                                                                 \
+static void kernel_set_rgba_##name(const KernelLayer *l, unsigned int x,         \
+		unsigned int y, uint32_t rgba) {                                         \
+	uint8_t *p = kernel_ptr(l, x, y, pow2, 4);                                   \
+	if (p == NULL)                                                               \
+		return;                                                                  \
+	p[0] = rgba >> 24;                                                           \
+	p[1] = rgba >> 16;                                                           \
+	p[2] = rgba >> 8;                                                            \
+	p[3] = rgba;                                                                 \
+}                                                                                \
+                                                                                 \
+static uint32_t kernel_get_rgba_##name(const KernelLayer *l, unsigned int x,     \
+		unsigned int y) {                                                        \
+	uint8_t *p = kernel_ptr(l, x, y, pow2, 4);                                   \
+	if (p == NULL)                                                               \
+		return 0;                                                                \
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | 0xff;                     \
+}
+
+KERNEL_DEFINE(pow2, 1)
+KERNEL_DEFINE(any, 0)
+
+// Row kernels
+
+// Clip a row to the layer. Return the number of pixels left.
+static inline unsigned int kernel_clip_row(const KernelLayer *l, unsigned int x,
+		unsigned int y, unsigned int count) {
+	if (x >= l->size || y >= l->size)
+		return 0;
+	return count < l->size - x ? count : l->size - x;
+}
+
+static void kernel_blend_row_rgb(const KernelLayer *l, unsigned int x,
+		unsigned int y, const uint32_t *rgba, unsigned int count) {
+	count = kernel_clip_row(l, x, y, count);
+	uint8_t *p = l->data + ((size_t) y * l->size + x) * 3;
+	for (unsigned int i = 0; i < count; i++, p += 3) {
+		uint32_t c = rgba[i], a = c & 0xff, na = 0xff - a;
+		p[0] = kernel_div255(((c >> 24) & 0xff) * a + p[0] * na);
+		p[1] = kernel_div255(((c >> 16) & 0xff) * a + p[1] * na);
+		p[2] = kernel_div255(((c >> 8) & 0xff) * a + p[2] * na);
+	}
+}
+
+static void kernel_blend_row_rgba(const KernelLayer *l, unsigned int x,
+		unsigned int y, const uint32_t *rgba, unsigned int count) {
+	count = kernel_clip_row(l, x, y, count);
+	uint8_t *p = l->data + ((size_t) y * l->size + x) * 4;
+	for (unsigned int i = 0; i < count; i++, p += 4) {
+		p[0] = rgba[i] >> 24;
+		p[1] = rgba[i] >> 16;
+		p[2] = rgba[i] >> 8;
+		p[3] = rgba[i];
+	}
+}
+
+// Span kernels
+
+static void kernel_blend_span_rgb(uint8_t *dst, size_t count, uint32_t rgba) {
+	uint32_t a = rgba & 0xff, na = 0xff - a;
+	uint32_t r = ((rgba >> 24) & 0xff) * a;
+	uint32_t g = ((rgba >> 16) & 0xff) * a;
+	uint32_t b = ((rgba >> 8) & 0xff) * a;
+	for (size_t i = 0; i < count; i++, dst += 3) {
+		dst[0] = kernel_div255(r + dst[0] * na);
+		dst[1] = kernel_div255(g + dst[1] * na);
+		dst[2] = kernel_div255(b + dst[2] * na);
+	}
+}
+
+static void kernel_blend_span_rgba(uint8_t *dst, size_t count, uint32_t rgba) {
+	uint8_t px[4] = { rgba >> 24, rgba >> 16, rgba >> 8, rgba };
+	for (size_t i = 0; i < count; i++, dst += 4)
+		memcpy(dst, px, 4);
+}
+
+#ifdef KERNEL_X86
+// RGB pixels do not fit into vector lanes, but 3 vectors always cover a whole
+// number of pixels. Each byte is blended in a 16 bit lane with one of three
+// precomputed color patterns. The tail is done by the scalar kernel.
+#define KERNEL_SPAN_SIMD(isa, width, flags)                                        \
+__attribute__((target(flags)))                                                     \
+static void kernel_blend_span_rgb_##isa(uint8_t *dst, size_t count, uint32_t rgba) { \
+	typedef uint8_t v8 __attribute__((vector_size(width)));                        \
+	typedef uint16_t v16 __attribute__((vector_size(width * 2)));                  \
+	uint8_t color[3] = { rgba >> 24, rgba >> 16, rgba >> 8 };                      \
+	uint16_t a = rgba & 0xff, na = 0xff - a;                                       \
+	size_t len = count * 3, pos = 0;                                               \
+	v16 ca[3];                                                                     \
+	/* color * alpha, plus the +1 of kernel_div255() */                            \
+	for (int j = 0; j < 3; j++)                                                    \
+		for (int i = 0; i < width; i++)                                            \
+			ca[j][i] = color[(j * width + i) % 3] * a + 1;                         \
+	for (; pos + 3 * width <= len; pos += 3 * width) {                             \
+		for (int j = 0; j < 3; j++) {                                              \
+			v8 in, out;                                                            \
+			memcpy(&in, dst + pos + j * width, width);                             \
+			v16 t = __builtin_convertvector(in, v16) * na + ca[j];                 \
+			out = __builtin_convertvector((t + (t >> 8)) >> 8, v8);                \
+			memcpy(dst + pos + j * width, &out, width);                            \
+		}                                                                          \
+	}                                                                              \
+	kernel_blend_span_rgb(dst + pos, (len - pos) / 3, rgba);                       \
+}
+
+KERNEL_SPAN_SIMD(sse2, 16, "sse2")
+KERNEL_SPAN_SIMD(avx2, 32, "avx2")
+KERNEL_SPAN_SIMD(avx512, 64, "avx512f,avx512bw")
+#endif
+
+static const char *kernel_isa_names[] = { "generic", "sse2", "avx2", "avx512" };
+
+// Public functions
+
+int kernel_detect_isa() {
+#ifdef KERNEL_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+		return KERNEL_ISA_AVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return KERNEL_ISA_AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return KERNEL_ISA_SSE2;
+#endif
+	return KERNEL_ISA_GENERIC;
+}
+
+void kernel_select(Kernels *k, uint8_t *data, unsigned int size,
+		unsigned int bpp, int isa) {
+	int pow2 = size && (size & (size - 1)) == 0;
+	int best = kernel_detect_isa();
+
+	if (isa > best)
+		isa = best;
+
+	k->layer.data = data;
+	k->layer.size = size;
+	k->layer.shift = pow2 ? __builtin_ctz(size) : 0;
+
+	if (bpp == 4) {
+		k->set = pow2 ? kernel_set_rgba_pow2 : kernel_set_rgba_any;
+		k->blend = k->set;
+		k->get = pow2 ? kernel_get_rgba_pow2 : kernel_get_rgba_any;
+		k->blend_span = kernel_blend_span_rgba;
+		k->blend_row = kernel_blend_row_rgba;
+		// Not vectorized by hand, the compiler does fine.
+		isa = KERNEL_ISA_GENERIC;
+	} else {
+		k->set = pow2 ? kernel_set_rgb_pow2 : kernel_set_rgb_any;
+		k->blend = pow2 ? kernel_blend_rgb_pow2 : kernel_blend_rgb_any;
+		k->get = pow2 ? kernel_get_rgb_pow2 : kernel_get_rgb_any;
+		k->blend_span = kernel_blend_span_rgb;
+		k->blend_row = kernel_blend_row_rgb;
+#ifdef KERNEL_X86
+		if (isa == KERNEL_ISA_AVX512)
+			k->blend_span = kernel_blend_span_rgb_avx512;
+		else if (isa == KERNEL_ISA_AVX2)
+			k->blend_span = kernel_blend_span_rgb_avx2;
+		else if (isa == KERNEL_ISA_SSE2)
+			k->blend_span = kernel_blend_span_rgb_sse2;
+#endif
+	}
+
+	snprintf(k->name, sizeof(k->name), "%s-%s-%s", bpp == 4 ? "rgba" : "rgb",
+			pow2 ? "pow2" : "any", kernel_isa_names[isa]);
+}
@@ -0,0 +1,58 @@
+#ifndef KERNEL_H_
+#define KERNEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Pixel kernels, specialized per pixel format (RGB or RGBA) and canvas
+// geometry (power-of-two or arbitrary size). The right set is selected once
+// by kernel_select(), so the hot path is a single indirect call without any
+// format, alpha or stride checks. Colors are 0xRRGGBBAA, like canvas_set_px().
+
+// Instruction set levels for the span kernels, in ascending order.
+#define KERNEL_ISA_GENERIC 0
+#define KERNEL_ISA_SSE2 1
+#define KERNEL_ISA_AVX2 2
+#define KERNEL_ISA_AVX512 3
+#define KERNEL_ISA_BEST 99 // Best level supported by the CPU
+
+typedef struct KernelLayer {
+	uint8_t *data;
+	unsigned int size;  // Width and height in pixels
+	unsigned int shift; // log2(size), only valid for power-of-two sizes
+} KernelLayer;
+
+typedef void (*kernel_set_px)(const KernelLayer *layer, unsigned int x,
+		unsigned int y, uint32_t rgba);
+typedef uint32_t (*kernel_get_px)(const KernelLayer *layer, unsigned int x,
+		unsigned int y);
+typedef void (*kernel_blend_span)(uint8_t *dst, size_t count, uint32_t rgba);
+typedef void (*kernel_blend_row)(const KernelLayer *layer, unsigned int x,
+		unsigned int y, const uint32_t *rgba, unsigned int count);
+
+typedef struct Kernels {
+	KernelLayer layer;
+	// Write a pixel, ignoring alpha on RGB layers and storing it on RGBA layers.
+	// Out of bound coordinates are ignored.
+	kernel_set_px set;
+	// Blend a pixel over an RGB layer. Same as set on RGBA layers.
+	kernel_set_px blend;
+	// Read a pixel (alpha is always 0xff), or 0 for out of bound coordinates.
+	kernel_get_px get;
+	// Blend a color over count consecutive pixels (RGB layers), or overwrite them (RGBA layers).
+	kernel_blend_span blend_span;
+	// Blend count colors over the pixels starting at (x, y) to the right, like
+	// blend for each of them. Pixels beyond the layer are ignored.
+	kernel_blend_row blend_row;
+	char name[32]; // e.g. "rgb-pow2-avx2"
+} Kernels;
+
+// Return the best instruction set level supported by this CPU.
+int kernel_detect_isa();
+
+// Select the kernels for a layer with 3 (RGB) or 4 (RGBA) bytes per pixel.
+// The isa level is capped at what the CPU supports.
+void kernel_select(Kernels *kernels, uint8_t *data, unsigned int size,
+		unsigned int bpp, int isa);
+
+#endif /* KERNEL_H_ */
@@ -0,0 +1,183 @@
+#define _GNU_SOURCE // sched_setaffinity
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mem.h"
+
+#define MEM_HUGE_PAGE (2 * 1024 * 1024)
+#define MEM_MAX_NODES 1024
+
+// Global state
+
+static int mem_numa_mode = MEM_NUMA_DEFAULT;
+static int mem_numa_node = 0;
+static const char *mem_kind = "none";
+
+// Helper functions
+
+static inline size_t mem_round(size_t size) {
+	return (size + MEM_HUGE_PAGE - 1) & ~((size_t) MEM_HUGE_PAGE - 1);
+}
+
+// Parse a sysfs list (e.g. "0-3,8,10-11") into a bitmask.
+// Return the number of bits set, or -1 on errors.
+static int mem_parse_list(const char *str, unsigned long *mask, size_t bits) {
+	int count = 0;
+	memset(mask, 0, bits / 8);
+	while (*str && *str != '\n') {
+		char *end;
+		unsigned long first = strtoul(str, &end, 10), last = first;
+		if (end == str)
+			return -1;
+		if (*end == '-')
+			last = strtoul(end + 1, &end, 10);
+		for (unsigned long i = first; i <= last && i < bits; i++, count++)
+			mask[i / (8 * sizeof(long))] |= 1ul << (i % (8 * sizeof(long)));
+		str = *end == ',' ? end + 1 : end;
+	}
+	return count;
+}
+
+static int mem_read_list(const char *path, unsigned long *mask, size_t bits) {
+	char buf[1024];
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	char *line = fgets(buf, sizeof(buf), f);
+	fclose(f);
+	return line ? mem_parse_list(line, mask, bits) : -1;
+}
+
+// Apply the NUMA policy to a fresh (not yet touched) mapping.
+static void mem_apply_numa(void *ptr, size_t len) {
+	unsigned long mask[MEM_MAX_NODES / (8 * sizeof(long))] = { 0 };
+	int mode;
+
+	if (mem_numa_mode == MEM_NUMA_INTERLEAVE) {
+		if (mem_read_list("/sys/devices/system/node/online", mask, MEM_MAX_NODES) <= 0)
+			return;
+		mode = MPOL_INTERLEAVE;
+	} else if (mem_numa_mode == MEM_NUMA_BIND) {
+		if (mem_numa_node < 0 || mem_numa_node >= MEM_MAX_NODES)
+			return;
+		mask[mem_numa_node / (8 * sizeof(long))] |= 1ul << (mem_numa_node % (8 * sizeof(long)));
+		mode = MPOL_BIND;
+	} else {
+		return;
+	}
+
+	// Raw syscall, so we do not depend on libnuma.
+	if (syscall(SYS_mbind, ptr, len, mode, mask, MEM_MAX_NODES, 0) != 0)
+		perror("mbind failed");
+}
+
+// Public functions
+
+void mem_set_numa(int mode, int node) {
+	mem_numa_mode = mode;
+	mem_numa_node = node;
+}
+
+int mem_nic_node(const char *iface) {
+	char path[256];
+	int node = -1;
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", iface);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	if (fscanf(f, "%d", &node) != 1)
+		node = -1;
+	fclose(f);
+	return node;
+}
+
+int mem_parse_numa(const char *policy) {
+	if (strcmp(policy, "interleave") == 0) {
+		mem_set_numa(MEM_NUMA_INTERLEAVE, 0);
+		return -1;
+	}
+
+	int node;
+	if (strncmp(policy, "nic:", 4) == 0) {
+		// Single-node machines and virtual NICs report -1. Keep the default then.
+		if ((node = mem_nic_node(policy + 4)) < 0) {
+			printf("No NUMA node known for network interface %s, using default placement\n",
+					policy + 4);
+			return -1;
+		}
+	} else {
+		char *end;
+		node = strtol(policy, &end, 10);
+		if (end == policy || *end || node < 0)
+			return -2;
+	}
+
+	mem_set_numa(MEM_NUMA_BIND, node);
+	return node;
+}
+
+int mem_pin_thread(int node) {
+	char path[128];
+	unsigned long mask[CPU_SETSIZE / (8 * sizeof(long))];
+	cpu_set_t cpus;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	if (mem_read_list(path, mask, CPU_SETSIZE) <= 0)
+		return -1;
+
+	CPU_ZERO(&cpus);
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (mask[cpu / (8 * sizeof(long))] & (1ul << (cpu % (8 * sizeof(long)))))
+			CPU_SET(cpu, &cpus);
+
+	return sched_setaffinity(0, sizeof(cpus), &cpus);
+}
+
+void* mem_alloc(size_t size) {
+	size_t len = mem_round(size);
+
+	// Explicit huge pages (needs vm.nr_hugepages > 0)
+	void *ptr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (ptr != MAP_FAILED) {
+		mem_kind = "hugetlb";
+		mem_apply_numa(ptr, len);
+		return ptr;
+	}
+
+	// Transparent huge pages need 2MB aligned mappings. Map more than needed
+	// and trim the unaligned parts.
+	uint8_t *raw = mmap(NULL, len + MEM_HUGE_PAGE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED) {
+		mem_kind = "none";
+		return NULL;
+	}
+
+	uint8_t *aligned = (uint8_t*) (((uintptr_t) raw + MEM_HUGE_PAGE - 1)
+			& ~((uintptr_t) MEM_HUGE_PAGE - 1));
+	if (aligned > raw)
+		munmap(raw, aligned - raw);
+	if (raw + MEM_HUGE_PAGE > aligned)
+		munmap(aligned + len, raw + MEM_HUGE_PAGE - aligned);
+
+	mem_kind = madvise(aligned, len, MADV_HUGEPAGE) == 0 ? "thp" : "4k";
+	mem_apply_numa(aligned, len);
+	return aligned;
+}
+
+void mem_free(void *ptr, size_t size) {
+	if (ptr)
+		munmap(ptr, mem_round(size));
+}
+
+const char* mem_last_kind() {
+	return mem_kind;
+}
@@ -0,0 +1,36 @@
+#ifndef MEM_H_
+#define MEM_H_
+
+#include <stddef.h>
+
+// Memory placement for large, randomly accessed buffers (e.g. the canvas).
+
+#define MEM_NUMA_DEFAULT 0    // Leave placement to the kernel (first touch)
+#define MEM_NUMA_INTERLEAVE 1 // Spread pages over all nodes
+#define MEM_NUMA_BIND 2       // Place pages on a single node
+
+// Set the NUMA policy for all following mem_alloc() calls.
+// The node is ignored unless mode is MEM_NUMA_BIND.
+void mem_set_numa(int mode, int node);
+
+// Parse a policy string ("interleave", a node number or "nic:<interface>")
+// and apply it with mem_set_numa(). Return the selected node for MEM_NUMA_BIND
+// policies, -1 for other valid policies and -2 on errors.
+int mem_parse_numa(const char *policy);
+
+// Return the NUMA node a network interface is attached to, or -1 if unknown.
+int mem_nic_node(const char *iface);
+
+// Pin the calling thread (and threads started by it) to the CPUs of a node.
+// Return 0 on success.
+int mem_pin_thread(int node);
+
+// Allocate zeroed memory, backed by huge pages if possible. Tries explicit
+// huge pages (hugetlbfs) first, then transparent huge pages, then normal pages.
+void* mem_alloc(size_t size);
+void mem_free(void *ptr, size_t size);
+
+// Describe the kind of memory the last mem_alloc() call returned.
+const char* mem_last_kind();
+
+#endif /* MEM_H_ */
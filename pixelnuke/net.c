@@ -7,6 +7,8 @@
 #include <event2/thread.h>
 #include <event2/bufferevent.h>
 
+#include <zlib.h>
+
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
@@ -14,8 +16,11 @@
 #include <stdio.h>
 #include <errno.h>
 #include <err.h>
+#include <stddef.h> // offsetof
 
 #include "net.h"
+#include "trace.h"
+#include "wheel.h"
 
 // Lines longer than this are considered an error.
 #define NET_MAX_LINE 1024
@@ -25,15 +30,49 @@
 // Higher values increase throughput but fast clients might be able to draw large batches at once.
 #define NET_MAX_BUFFER 10240
 
+// If a client does not read its responses fast enough and its output buffer
+// grows beyond NET_OUTPUT_HIGH bytes, the server stops reading input from it
+// until the output buffer drained below NET_OUTPUT_LOW bytes. Clients that
+// buffer more than NET_MEMORY_BUDGET bytes (input + output) anyway are disconnected.
+#define NET_OUTPUT_LOW 4096
+#define NET_OUTPUT_HIGH 16384
+#define NET_MEMORY_BUDGET 262144
+
+// Clients that did not send anything for this many seconds are disconnected.
+#define NET_IDLE_TIMEOUT 60
+
+// Compressed input (see net_set_compressed) is decompressed in steps of at
+// most NET_MAX_BUFFER bytes per read callback, so compressed clients get the
+// same share as everyone else. Clients with a compression ratio above
+// NET_INFLATE_MAX_RATIO (after NET_INFLATE_MIN_OUT decompressed bytes) are
+// disconnected to protect against decompression bombs.
+#define NET_INFLATE_MAX_RATIO 500
+#define NET_INFLATE_MIN_OUT (1024 * 1024)
+// Approximate memory used by zlib for a single inflate stream
+#define NET_INFLATE_STATE (40 * 1024)
+
 typedef struct NetClient {
 	int sock_fd;
 	struct bufferevent *buf_ev;
 	int state;
+	int paused;
+	int held; // Number of net_pause() calls not yet resumed
 	void *user;
+	// Idle timer. Only the last activity is updated on reads, the timer
+	// itself is re-scheduled lazily when it fires.
+	WheelNode idle;
+	uint64_t last_active;
+	// Decompression state. Once a client switched to compressed input, lines
+	// are read from zbuf instead of the bufferevent input buffer.
+	z_stream *zs;
+	struct evbuffer *zbuf;
+	uint64_t z_in;
+	uint64_t z_out;
 } NetClient;
 
 #define NET_CSTATE_OPEN 0
 #define NET_CSTATE_CLOSING 1
+#define NET_CSTATE_KILLED 2
 
 static inline int min(int a, int b) {
 	return a < b ? a : b;
@@ -42,14 +81,164 @@ static inline int min(int a, int b) {
 // global state
 static struct event_base *base;
 static char * line_buffer;
+static NetStats stats;
+static TimerWheel idle_wheel;
+static struct event *idle_event;
+static unsigned int idle_timeout = NET_IDLE_TIMEOUT;
+static size_t memory_budget = NET_MEMORY_BUDGET;
 
 // User defined callbacks
 static net_on_connect netcb_on_connect = NULL;
 static net_on_read netcb_on_read = NULL;
 static net_on_close netcb_on_close = NULL;
 
+static void netev_on_read(struct bufferevent *bev, void *ctx);
+static void net_on_output_change(struct evbuffer *buffer,
+		const struct evbuffer_cb_info *info, void *arg);
+
+// Close the connection and free all resources of a client.
+static void net_free(NetClient *client) {
+	struct evbuffer *output = bufferevent_get_output(client->buf_ev);
+	// Output still pending is dropped with the bufferevent. The buffer is
+	// frozen by libevent, so it cannot be drained here.
+	stats.buffered -= evbuffer_get_length(output);
+	evbuffer_remove_cb(output, net_on_output_change, NULL);
+	if (client->paused)
+		stats.paused--;
+	if (client->held)
+		stats.held--;
+	wheel_remove(&client->idle);
+	if (client->zs) {
+		inflateEnd(client->zs);
+		free(client->zs);
+	}
+	if (client->zbuf)
+		evbuffer_free(client->zbuf);
+	bufferevent_free(client->buf_ev);
+	free(client);
+}
+
+// Free a client that was killed from within a callback.
+static void net_free_deferred(evutil_socket_t fd, short event, void *arg) {
+	NetClient *client = arg;
+
+	if (netcb_on_close)
+		(*netcb_on_close)(client, BEV_EVENT_ERROR);
+
+	net_free(client);
+}
+
+static inline size_t net_client_memory(NetClient *client) {
+	return evbuffer_get_length(bufferevent_get_input(client->buf_ev))
+			+ evbuffer_get_length(bufferevent_get_output(client->buf_ev))
+			+ (client->zbuf ? evbuffer_get_length(client->zbuf) : 0)
+			+ (client->zs ? NET_INFLATE_STATE : 0)
+			+ sizeof(NetClient);
+}
+
+// Move up to `budget` bytes of decoded input from the bufferevent input to zbuf,
+// directly from the input chunks. Return the number of bytes produced, or -1 on errors.
+static int net_decode(NetClient *client, struct evbuffer *input, size_t budget) {
+	z_stream *zs = client->zs;
+	size_t produced = 0;
+
+	while (produced < budget && evbuffer_get_length(input) > 0) {
+		struct evbuffer_iovec in, out;
+		if (evbuffer_peek(input, -1, NULL, &in, 1) < 1
+				|| evbuffer_reserve_space(client->zbuf, budget - produced, &out, 1) < 1)
+			return -1;
+
+		size_t out_len = out.iov_len < budget - produced ? out.iov_len : budget - produced;
+		zs->next_in = in.iov_base;
+		zs->avail_in = in.iov_len;
+		zs->next_out = out.iov_base;
+		zs->avail_out = out_len;
+
+		int ret = inflate(zs, Z_NO_FLUSH);
+		size_t consumed = in.iov_len - zs->avail_in;
+		out.iov_len = out_len - zs->avail_out;
+
+		evbuffer_commit_space(client->zbuf, &out, 1);
+		evbuffer_drain(input, consumed);
+		client->z_in += consumed;
+		client->z_out += out.iov_len;
+		produced += out.iov_len;
+
+		if (ret == Z_STREAM_END) {
+			// Back to plain input
+			inflateEnd(zs);
+			free(zs);
+			client->zs = NULL;
+			break;
+		}
+		if (ret != Z_OK && ret != Z_BUF_ERROR)
+			return -1;
+		if (consumed == 0 && out.iov_len == 0)
+			break; // Needs more input
+	}
+
+	if (client->z_out > NET_INFLATE_MIN_OUT
+			&& client->z_out > client->z_in * NET_INFLATE_MAX_RATIO)
+		return -1;
+
+	return produced;
+}
+
+// Disconnect a client immediately. Buffered output is discarded when the
+// client is freed. The client struct stays valid until the current callback returned.
+static void net_kill(NetClient *client) {
+	if (client->state == NET_CSTATE_KILLED)
+		return;
+	client->state = NET_CSTATE_KILLED;
+	stats.reclaimed += net_client_memory(client);
+	bufferevent_disable(client->buf_ev, EV_READ | EV_WRITE);
+	event_base_once(base, -1, EV_TIMEOUT, net_free_deferred, client, NULL);
+}
+
+// Check the output buffer size after something was added to it.
+static void net_check_output(NetClient *client) {
+	size_t len = evbuffer_get_length(bufferevent_get_output(client->buf_ev));
+
+	if (memory_budget && net_client_memory(client) > memory_budget) {
+		stats.killed++;
+		net_kill(client);
+	} else if (len > NET_OUTPUT_HIGH && !client->paused
+			&& client->state == NET_CSTATE_OPEN) {
+		// Stop reading until netev_on_write reports a drained buffer
+		client->paused = 1;
+		stats.paused++;
+		bufferevent_disable(client->buf_ev, EV_READ);
+		bufferevent_setwatermark(client->buf_ev, EV_WRITE, NET_OUTPUT_LOW, 0);
+	}
+}
+
+// Keep track of the total number of bytes waiting in output buffers.
+static void net_on_output_change(struct evbuffer *buffer,
+		const struct evbuffer_cb_info *info, void *arg) {
+	stats.buffered += info->n_added;
+	stats.buffered -= info->n_deleted;
+}
+
+// Called by the idle wheel when a client might have been idle for too long.
+static void net_on_idle(WheelNode *node, void *arg) {
+	NetClient *client = (NetClient*) ((char*) node - offsetof(NetClient, idle));
+	uint64_t deadline = client->last_active + idle_timeout;
+
+	if (idle_timeout && deadline > idle_wheel.now) {
+		// There was some activity in the meantime
+		wheel_add(&idle_wheel, node, deadline);
+	} else if (idle_timeout && client->state != NET_CSTATE_KILLED) {
+		stats.evicted++;
+		net_kill(client);
+	}
+}
+
 // libevent callbacks
 
+static void netev_on_tick(evutil_socket_t fd, short event, void *arg) {
+	wheel_tick(&idle_wheel, net_on_idle, NULL);
+}
+
 
 // Like evbuffer_readln, but read into an existing string instead of allocating a new one.
 // Return 1 if a line ending was found and the line was read completely.
@@ -86,29 +275,93 @@ static void netev_on_read(struct bufferevent *bev, void *ctx) {
 	int r = 0;
 
 	input = bufferevent_get_input(bev);
+	client->last_active = idle_wheel.now;
+	trace_read_ts = trace_now();
+	TRACE_PROBE1(net_read, evbuffer_get_length(input));
 
 	// Change while->if for less throughput but more fair pixel distribution across client connections.
-	while ((r = net_evbuffer_readln(input, line_buffer, NET_MAX_LINE, NULL, EVBUFFER_EOL_LF)) == 1) {
+	// Stop early if the client was closed or paused by the callback. Remaining lines stay in the buffer.
+	size_t budget = NET_MAX_BUFFER;
+	while (client->state == NET_CSTATE_OPEN && !client->paused && !client->held) {
+		// The callback may switch to compressed input at any line.
+		struct evbuffer *lines = client->zbuf ? client->zbuf : input;
+		r = net_evbuffer_readln(lines, line_buffer, NET_MAX_LINE, NULL, EVBUFFER_EOL_LF);
+
+		if (r == 0 && client->zbuf && !client->zs) {
+			// All complete lines of a finished stream were read. Continue
+			// with plain input, starting with what is left of the last line.
+			if (evbuffer_prepend_buffer(input, client->zbuf) != 0) {
+				net_err(client, "Out of memory");
+				return;
+			}
+			evbuffer_free(client->zbuf);
+			client->zbuf = NULL;
+			continue;
+		}
+
+		if (r == 0 && client->zbuf) {
+			if (evbuffer_get_length(client->zbuf) >= NET_MAX_LINE) {
+				r = 2;
+				break;
+			}
+			int n = budget ? net_decode(client, input, budget) : 0;
+			if (n < 0) {
+				net_err(client, "Invalid or suspicious compressed data");
+				return;
+			}
+			if (n == 0)
+				break;
+			budget -= n;
+			continue;
+		}
+
+		if (r != 1)
+			break;
 		(*netcb_on_read)(client, line_buffer);
 	}
 
-	if (r == 2) {
+	if (r == 2 && client->state == NET_CSTATE_OPEN) {
 		net_err(client, "Line to long");
 	}
+
+	// Budget used up, but there is more. Continue in the next loop iteration,
+	// as no new read event fires while the input buffer is full.
+	if (client->zbuf && budget == 0 && client->state == NET_CSTATE_OPEN
+			&& !client->paused && !client->held && evbuffer_get_length(input) > 0) {
+		bufferevent_trigger(bev, EV_READ,
+				BEV_TRIG_IGNORE_WATERMARKS | BEV_TRIG_DEFER_CALLBACKS);
+	}
+
+	if (memory_budget && client->state != NET_CSTATE_KILLED
+			&& net_client_memory(client) > memory_budget) {
+		stats.killed++;
+		net_kill(client);
+	}
 }
 
 
 static void netev_on_write(struct bufferevent *bev, void *arg) {
 	NetClient *client = arg;
 
+	if (client->paused
+			&& evbuffer_get_length(bufferevent_get_output(bev)) <= NET_OUTPUT_LOW) {
+		client->paused = 0;
+		stats.paused--;
+		bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+		if (client->state == NET_CSTATE_OPEN && !client->held) {
+			bufferevent_enable(bev, EV_READ);
+			// Process lines that are already buffered. No read event will fire for those.
+			netev_on_read(bev, client);
+		}
+	}
+
 	if (client->state == NET_CSTATE_CLOSING
 			&& evbuffer_get_length(bufferevent_get_output(bev)) == 0) {
 
 		if (netcb_on_close)
 			(*netcb_on_close)(client, 0);
 
-		bufferevent_free(bev);
-		free(client);
+		net_free(client);
 	}
 }
 
@@ -121,12 +374,13 @@ static void netev_on_error(struct bufferevent *bev, short error, void *arg) {
 	} else if (error & BEV_EVENT_TIMEOUT) {
 	}
 
+	TRACE_PROBE1(net_error, error);
+
 	client->state = NET_CSTATE_CLOSING;
 	if (netcb_on_close)
 		(*netcb_on_close)(client, error);
 
-	bufferevent_free(bev);
-	free(client);
+	net_free(client);
 }
 
 static void on_accept(evutil_socket_t listener, short event, void *arg) {
@@ -154,6 +408,14 @@ static void on_accept(evutil_socket_t listener, short event, void *arg) {
 		bufferevent_setcb(client->buf_ev, netev_on_read, netev_on_write,
 				netev_on_error, client);
 		bufferevent_setwatermark(client->buf_ev, EV_READ, 0, NET_MAX_BUFFER);
+		evbuffer_add_cb(bufferevent_get_output(client->buf_ev),
+				net_on_output_change, NULL);
+
+		client->last_active = idle_wheel.now;
+		if (idle_timeout)
+			wheel_add(&idle_wheel, &client->idle, idle_wheel.now + idle_timeout);
+
+		TRACE_PROBE1(net_accept, fd);
 
 		if (netcb_on_connect)
 			(*netcb_on_connect)(client);
@@ -173,23 +435,17 @@ void net_start(int port, net_on_connect on_connect, net_on_read on_read,
 
 	line_buffer = malloc(sizeof(char)*NET_MAX_LINE);
 
-	evthread_use_pthreads();
-
 	//setvbuf(stdout, NULL, _IONBF, 0);
 
 	netcb_on_connect = on_connect;
 	netcb_on_read = on_read;
 	netcb_on_close = on_close;
 
-	base = event_base_new();
-	if (!base)
-		err(1, "Failed to create event_base");
-
-	//evthread_make_base_notifiable(base);
+	base = net_base();
 
 	sin.sin_family = AF_INET;
 	sin.sin_addr.s_addr = 0;
-	sin.sin_port = htons(1337);
+	sin.sin_port = htons(port);
 	listener = socket(AF_INET, SOCK_STREAM, 0);
 	evutil_make_socket_nonblocking(listener);
 	evutil_make_listen_socket_reuseable(listener);
@@ -206,9 +462,25 @@ void net_start(int port, net_on_connect on_connect, net_on_read on_read,
 			(void*) base);
 	event_add(listener_event, NULL);
 
+	struct timeval tick = { 1, 0 };
+	wheel_init(&idle_wheel);
+	idle_event = event_new(base, -1, EV_PERSIST, netev_on_tick, NULL);
+	event_add(idle_event, &tick);
+
 	event_base_dispatch(base);
 }
 
+struct event_base* net_base() {
+	if (!base) {
+		evthread_use_pthreads();
+		base = event_base_new();
+		if (!base)
+			err(1, "Failed to create event_base");
+		//evthread_make_base_notifiable(base);
+	}
+	return base;
+}
+
 void net_stop() {
 	event_base_loopbreak(base);
 	if(line_buffer) {
@@ -218,24 +490,87 @@ void net_stop() {
 }
 
 void net_send(NetClient *client, const char * msg) {
+	if (client->state == NET_CSTATE_KILLED)
+		return;
 	struct evbuffer *output = bufferevent_get_output(client->buf_ev);
 	evbuffer_add(output, msg, strlen(msg));
 	evbuffer_add(output, "\n", 1);
+	net_check_output(client);
 }
 
 void net_close(NetClient *client) {
 	if (client->state == NET_CSTATE_OPEN) {
 		client->state = NET_CSTATE_CLOSING;
 		bufferevent_disable(client->buf_ev, EV_READ);
+		// Closing is handled by netev_on_write once the buffer is empty
+		bufferevent_setwatermark(client->buf_ev, EV_WRITE, 0, 0);
 	}
 }
 
 void net_err(NetClient *client, const char * msg) {
+	if (client->state == NET_CSTATE_KILLED)
+		return;
 	struct evbuffer *output = bufferevent_get_output(client->buf_ev);
 	evbuffer_add(output, "ERROR: ", 7);
 	evbuffer_add(output, msg, strlen(msg));
 	evbuffer_add(output, "\n", 1);
 	net_close(client);
+	net_check_output(client);
+}
+
+void net_pause(NetClient *client) {
+	if (client->held++ == 0) {
+		stats.held++;
+		bufferevent_disable(client->buf_ev, EV_READ);
+	}
+}
+
+void net_resume(NetClient *client) {
+	if (client->held == 0 || --client->held > 0)
+		return;
+	stats.held--;
+	if (client->state == NET_CSTATE_OPEN && !client->paused) {
+		bufferevent_enable(client->buf_ev, EV_READ);
+		// Process lines that are already buffered, but not from within the
+		// caller, which may be in the middle of another client's callback.
+		bufferevent_trigger(client->buf_ev, EV_READ,
+				BEV_TRIG_IGNORE_WATERMARKS | BEV_TRIG_DEFER_CALLBACKS);
+	}
+}
+
+void net_set_idle_timeout(unsigned int seconds) {
+	idle_timeout = seconds;
+}
+
+void net_set_memory_budget(size_t bytes) {
+	memory_budget = bytes;
+}
+
+void net_get_stats(NetStats *out) {
+	*out = stats;
+}
+
+int net_set_compressed(NetClient *client) {
+	// Nested streams are not supported
+	if (client->zbuf)
+		return 0;
+
+	z_stream *zs = calloc(1, sizeof(z_stream));
+	if (zs == NULL)
+		return -1;
+	// zlib or gzip header, detected automatically
+	if (inflateInit2(zs, 15 + 32) != Z_OK) {
+		free(zs);
+		return -1;
+	}
+	if (!(client->zbuf = evbuffer_new())) {
+		inflateEnd(zs);
+		free(zs);
+		return -1;
+	}
+
+	client->zs = zs;
+	return 0;
 }
 
 void net_set_user(NetClient *client, void *user) {
@@ -1,10 +1,29 @@
 #ifndef NET_H_
 #define NET_H_
 
+#include <stddef.h>
+
 typedef struct NetClient NetClient;
+struct event_base;
 
 #define NET_CSTATE_OPEN 0
 #define NET_CSTATE_CLOSING 1
+#define NET_CSTATE_KILLED 2
+
+typedef struct NetStats {
+	// Number of clients currently not read from, because they do not read their responses
+	unsigned int paused;
+	// Number of clients currently not read from, because the application paused them (see net_pause)
+	unsigned int held;
+	// Number of clients disconnected for exceeding the per-connection memory budget
+	unsigned int killed;
+	// Number of clients disconnected for being idle for too long
+	unsigned int evicted;
+	// Total number of bytes waiting in output buffers
+	size_t buffered;
+	// Total number of bytes freed by disconnecting killed or evicted clients
+	size_t reclaimed;
+} NetStats;
 
 // Callback called immediately after a client connects
 typedef void (*net_on_connect)(NetClient *client);
@@ -24,6 +43,10 @@ void net_start(int port, net_on_connect on_connect, net_on_read on_read, net_on_
 // Stop the server as soon as possible
 void net_stop();
 
+// Return the event base used by the server (created on first call), e.g. to
+// add additional connections or timers before calling net_start().
+struct event_base* net_base();
+
 // Send a string to the client. A newline is added automatically.
 void net_send(NetClient *client, const char * msg);
 // Stop reading from this clients socket, send all bytes still in the output buffer, then close the connection.
@@ -31,6 +54,27 @@ void net_close(NetClient *client);
 // Send an error message to the client, then close the connection.
 void net_err(NetClient *client, const char * msg);
 
+// Stop reading from this client, e.g. while its commands cannot be processed.
+// Lines already read stay buffered. Calls are counted, reading continues once
+// net_resume() was called as often as net_pause().
+void net_pause(NetClient *client);
+void net_resume(NetClient *client);
+
+// Disconnect clients that did not send anything for this many seconds (0 disables the timeout)
+void net_set_idle_timeout(unsigned int seconds);
+// Disconnect clients that buffer more than this many bytes (0 disables the limit)
+void net_set_memory_budget(size_t bytes);
+
+// Get server statistics
+void net_get_stats(NetStats *stats);
+
+// Treat all further input of this client as a zlib (or gzip) compressed
+// stream, starting right after the current line. After the end of the
+// compressed stream, input is read uncompressed again and compression can be
+// enabled again. Does nothing for lines read from a compressed stream.
+// Return 0 on success, -1 on errors.
+int net_set_compressed(NetClient *client);
+
 // Get or set the user attachment, a pointer to an arbitrary data structure or NULL
 void net_set_user(NetClient *client, void *user);
 void net_get_user(NetClient *client, void **user);
@@ -0,0 +1,126 @@
+#ifndef PARSE_H_
+#define PARSE_H_
+
+#include <stdint.h>
+
+// Fast parsing helpers shared by the server and the cluster frontend.
+
+static inline int fast_str_startswith(const char* prefix, const char* str) {
+	char cp, cs;
+	while ((cp = *prefix++) == (cs = *str++)) {
+		if (cp == 0)
+			return 1;
+	}
+	return !cp;
+}
+
+// Decimal string to unsigned int. This variant does NOT consume +, - or whitespace.
+// If **endptr is not NULL, it will point to the first non-decimal character, which
+// may be \0 at the end of the string.
+static inline uint32_t fast_strtoul10(const char *str, const char **endptr) {
+	uint32_t result = 0;
+	unsigned char c;
+	for (; (c = *str - '0') <= 9; str++)
+		result = result * 10 + c;
+	if (endptr)
+		*endptr = str;
+	return result;
+}
+
+// Same as fast_strtoul10, but for hex strings.
+static inline uint32_t fast_strtoul16(const char *str, const char **endptr) {
+	uint32_t result = 0;
+	unsigned char c;
+	while ((c = *str - '0') <= 9 // 0-9
+			|| ((c -= 7) >= 10 && c <= 15) // A-F
+			|| ((c -= 32) >= 10 && c <= 15)) { // a-f
+		result = result * 16 + c;
+		str++;
+	}
+	if (endptr)
+		*endptr = str;
+	return result;
+}
+
+// Arguments of a PX command
+typedef struct ParsePx {
+	uint32_t x;
+	uint32_t y;
+	uint32_t rgba;          // 0xRRGGBBAA, only valid for writes
+	const char *color;      // The hex color as sent, only valid for writes
+	unsigned int color_len; // 2, 6 or 8 for writes, 0 for reads
+} ParsePx;
+
+// Parse the arguments of `PX <x> <y>` or `PX <x> <y> BB|RRGGBB|RRGGBBAA`
+// (the part after "PX "). Return NULL on success, or an error message.
+static inline const char* parse_px(const char *ptr, ParsePx *px) {
+	const char *endptr = ptr;
+
+	px->x = fast_strtoul10(ptr, &endptr);
+	if (endptr == ptr)
+		return "Invalid command (expected decimal as first parameter)";
+	if (*endptr == '\0')
+		return "Invalid command (second parameter required)";
+
+	endptr++; // eat space (or whatever non-decimal is found here)
+
+	px->y = fast_strtoul10((ptr = endptr), &endptr);
+	if (endptr == ptr)
+		return "Invalid command (expected decimal as second parameter)";
+
+	// PX <x> <y> -> Read
+	if (*endptr == '\0') {
+		px->color_len = 0;
+		return NULL;
+	}
+
+	endptr++; // eat space (or whatever non-decimal is found here)
+
+	// PX <x> <y> BB|RRGGBB|RRGGBBAA
+	uint32_t c = fast_strtoul16((ptr = endptr), &endptr);
+	if (endptr == ptr)
+		return "Third parameter missing or invalid (should be hex color)";
+
+	px->color = ptr;
+	px->color_len = endptr - ptr;
+	if (px->color_len == 6) {
+		// RGB -> RGBA (most common)
+		px->rgba = (c << 8) + 0xff;
+	} else if (px->color_len == 8) {
+		px->rgba = c;
+	} else if (px->color_len == 2) {
+		// WW -> RGBA
+		px->rgba = (c << 24) + (c << 16) + (c << 8) + 0xff;
+	} else {
+		return "Color hex code must be 2, 6 or 8 characters long (WW, RGB or RGBA)";
+	}
+	return NULL;
+}
+
+// Parse the arguments of `OFFSET <x> <y>` (the part after "OFFSET ").
+// Return NULL on success, or an error message.
+static inline const char* parse_offset(const char *ptr, uint32_t *x, uint32_t *y) {
+	const char *endptr = ptr;
+
+	*x = fast_strtoul10(ptr, &endptr);
+	if (endptr == ptr || *endptr == '\0')
+		return "Invalid command (expected OFFSET x y)";
+
+	endptr++; // eat space (or whatever non-decimal is found here)
+
+	*y = fast_strtoul10((ptr = endptr), &endptr);
+	if (endptr == ptr || *endptr != '\0')
+		return "Invalid command (expected OFFSET x y)";
+	return NULL;
+}
+
+// Help text for the commands supported by both the server and the frontend
+#define PARSE_HELP "\
+PX x y: Get color at position (x,y)\n\
+PX x y rrggbb(aa): Draw a pixel (with optional alpha channel)\n\
+OFFSET x y: Add (x,y) to the coordinates of all following PX commands\n\
+COMPRESS: Continue with a zlib compressed stream (back to plain text after its end)\n\
+SIZE: Get canvas size\n\
+STATS: Return statistics"
+
+#endif /* PARSE_H_ */
@@ -1,130 +1,119 @@
 #include "net.h"
 #include "canvas.h"
+#include "trace.h"
+#include "parse.h"
+#include "route.h"
+#include "mem.h"
+#include "ingest.h"
 
 #include <stdlib.h>
 #include <errno.h>
 #include <stdio.h> //sprintf
+#include <unistd.h> //getopt
 
 unsigned int px_width = 1024;
 unsigned int px_height = 1024;
 unsigned int px_pixelcount = 0;
 unsigned int px_clientcount = 0;
 
+// Canvas kernels, set once the canvas is started
+const Kernels *px_kernels;
+
 // User sessions
 typedef struct PxSession {
-
+	// Added to all PX coordinates (see OFFSET command)
+	unsigned int offset_x;
+	unsigned int offset_y;
 } PxSession;
 
-// Helper functions
-
-static inline int fast_str_startswith(const char* prefix, const char* str) {
-	char cp, cs;
-	while ((cp = *prefix++) == (cs = *str++)) {
-		if (cp == 0)
-			return 1;
-	}
-	return !cp;
-}
-
-// Decimal string to unsigned int. This variant does NOT consume +, - or whitespace.
-// If **endptr is not NULL, it will point to the first non-decimal character, which
-// may be \0 at the end of the string.
-static inline uint32_t fast_strtoul10(const char *str, const char **endptr) {
-	uint32_t result = 0;
-	unsigned char c;
-	for (; (c = *str - '0') <= 9; str++)
-		result = result * 10 + c;
-	if (endptr)
-		*endptr = str;
-	return result;
-}
-
-// Same as fast_strtoul10, but for hex strings.
-static inline uint32_t fast_strtoul16(const char *str, const char **endptr) {
-	uint32_t result = 0;
-	unsigned char c;
-	while ((c = *str - '0') <= 9 // 0-9
-			|| ((c -= 7) >= 10 && c <= 15) // A-F
-			|| ((c -= 32) >= 10 && c <= 15)) { // a-f
-		result = result * 16 + c;
-		str++;
-	}
-	if (endptr)
-		*endptr = str;
-	return result;
-}
-
 // server callbacks
 void px_on_connect(NetClient *client) {
+	PxSession *session = calloc(1, sizeof(PxSession));
+	if (session == NULL) {
+		net_err(client, "Out of memory");
+		return;
+	}
+	net_set_user(client, session);
 	px_clientcount++;
 }
 
 void px_on_close(NetClient *client, int error) {
+	PxSession *session;
+	net_get_user(client, (void**) &session);
+	if (session == NULL)
+		return;
+	net_set_user(client, NULL);
+	free(session);
 	px_clientcount--;
 }
 
 void px_on_read(NetClient *client, char *line) {
+	PxSession *session;
+	net_get_user(client, (void**) &session);
+
+	// Timestamp of sampled lines, or 0
+	uint64_t t_sample = 0;
+	if (trace_sample()) {
+		t_sample = trace_now();
+		trace_record(TRACE_QUEUE, t_sample - trace_read_ts);
+	}
+
 	if (fast_str_startswith("PX ", line)) {
-		const char * ptr = line + 3;
-		const char * endptr = ptr;
-		errno = 0;
-
-		uint32_t x = fast_strtoul10(ptr, &endptr);
-		if (endptr == ptr) {
-			net_err(client,
-					"Invalid command (expected decimal as first parameter)");
-			return;
-		}
-		if (*endptr == '\0') {
-			net_err(client, "Invalid command (second parameter required)");
+		ParsePx px;
+		const char *error = parse_px(line + 3, &px);
+		if (error) {
+			net_err(client, error);
 			return;
 		}
 
-		endptr++; // eat space (or whatever non-decimal is found here)
-
-		uint32_t y = fast_strtoul10((ptr = endptr), &endptr);
-		if (endptr == ptr) {
-			net_err(client,
-					"Invalid command (expected decimal as second parameter)");
-			return;
-		}
+		uint32_t x = px.x + session->offset_x;
+		uint32_t y = px.y + session->offset_y;
 
 		// PX <x> <y> -> Get RGB color at position (x,y) or '0x000000' for out-of-range queries
-		if (*endptr == '\0') {
-			uint32_t c;
-			canvas_get_px(x, y, &c);
+		if (px.color_len == 0) {
+			uint32_t c = px_kernels->get(&px_kernels->layer, x, y);
 			char str[64];
-			sprintf(str, "PX %u %u %06X", x, y, (c >> 8));
+			sprintf(str, "PX %u %u %06X", px.x, px.y, (c >> 8));
 			net_send(client, str);
 			return;
 		}
 
-		endptr++; // eat space (or whatever non-decimal is found here)
+		// Opaque colors do not need to be blended
+		kernel_set_px kernel = px.color_len == 8 ? px_kernels->blend : px_kernels->set;
+		uint32_t c = px.rgba;
 
-		// PX <x> <y> BB|RRGGBB|RRGGBBAA
-		uint32_t c = fast_strtoul16((ptr = endptr), &endptr);
-		if (endptr == ptr) {
-			net_err(client,
-					"Third parameter missing or invalid (should be hex color)");
+		px_pixelcount++;
+		TRACE_PROBE3(canvas_set_px, x, y, c);
+
+		if (t_sample) {
+			uint64_t t_parsed = trace_now();
+			trace_record(TRACE_PARSE, t_parsed - t_sample);
+			kernel(&px_kernels->layer, x, y, c);
+			uint64_t t_applied = trace_now();
+			trace_record(TRACE_APPLY, t_applied - t_parsed);
+			trace_px_applied(t_applied);
 			return;
 		}
 
-		if (endptr - ptr == 6) {
-			// RGB -> RGBA (most common)
-			c = (c << 8) + 0xff;
-		} else if (endptr - ptr == 8) {
-			// done
-		} else if (endptr - ptr == 2) {
-			// WW -> RGBA
-			c = (c << 24) + (c << 16) + (c << 8) + 0xff;
-		} else {
-			net_err(client,
-					"Color hex code must be 2, 6 or 8 characters long (WW, RGB or RGBA)");
+		kernel(&px_kernels->layer, x, y, c);
+
+	} else if (fast_str_startswith("OFFSET ", line)) {
+
+		// OFFSET <x> <y> -> Add (x,y) to all following PX coordinates
+		uint32_t x, y;
+		const char *error = parse_offset(line + 7, &x, &y);
+		if (error) {
+			net_err(client, error);
 			return;
 		}
 
-		px_pixelcount++;
-		canvas_set_px(x, y, c);
+		session->offset_x = x;
+		session->offset_y = y;
+
+	} else if (fast_str_startswith("COMPRESS", line)) {
+
+		if (net_set_compressed(client) != 0)
+			net_err(client, "Failed to initialize decompression");
 
 	} else if (fast_str_startswith("SIZE", line)) {
 
@@ -134,19 +123,39 @@ void px_on_read(NetClient *client, char *line) {
 
 	} else if (fast_str_startswith("STATS", line)) {
 
-		char str[128];
-		snprintf(str, 128, "STATS px:%u conn:%u", px_pixelcount,
-				px_clientcount);
+		NetStats stats;
+		CanvasStats frames;
+		net_get_stats(&stats);
+		canvas_get_stats(&frames);
+		char str[256];
+		snprintf(str, 256, "STATS px:%u conn:%u ingest:%u paused:%u killed:%u evicted:%u outbuf:%zu reclaimed:%zu"
+				" frames:%u missed:%u frame_us:%u work_us:%u",
+				px_pixelcount, px_clientcount, ingest_count(), stats.paused,
+				stats.killed, stats.evicted, stats.buffered, stats.reclaimed,
+				frames.frames, frames.missed, frames.frame_us, frames.work_us);
+		net_send(client, str);
+
+	} else if (fast_str_startswith("TRACE", line)) {
+
+		// TRACE <n> -> Measure every n-th line (0 disables tracing)
+		if (line[5] == ' ') {
+			const char * endptr = line + 6;
+			uint32_t rate = fast_strtoul10(line + 6, &endptr);
+			if (endptr == line + 6 || *endptr != '\0') {
+				net_err(client, "Invalid command (expected TRACE or TRACE n)");
+				return;
+			}
+			trace_set_sample_rate(rate);
+		}
+
+		char str[1024];
+		trace_format(str, sizeof(str));
 		net_send(client, str);
 
 	} else if (fast_str_startswith("HELP", line)) {
 
-		net_send(client,
-				"\
-PX x y: Get color at position (x,y)\n\
-PX x y rrggbb(aa): Draw a pixel (with optional alpha channel)\n\
-SIZE: Get canvas size\n\
-STATS: Return statistics");
+		net_send(client, PARSE_HELP "\n\
+TRACE (n): Return latency histograms (and measure every n-th line)");
 
 	} else {
 
@@ -155,6 +164,21 @@ STATS: Return statistics");
 	}
 }
 
+// local ingest callbacks
+
+void px_on_ingest_pixels(const IngestPixel *px, unsigned int count) {
+	px_pixelcount += count;
+	for (unsigned int i = 0; i < count; i++)
+		px_kernels->blend(&px_kernels->layer, px[i].x, px[i].y, px[i].rgba);
+}
+
+void px_on_ingest_rect(unsigned int x, unsigned int y, unsigned int w,
+		unsigned int h, const uint32_t *rgba) {
+	px_pixelcount += w * h;
+	for (unsigned int j = 0; j < h; j++, rgba += w)
+		px_kernels->blend_row(&px_kernels->layer, x, y + j, rgba, w);
+}
+
 void px_on_key(int key, int scancode, int mods) {
 
 	printf("Key pressed: key:%d scancode:%d mods:%d\n", key, scancode, mods);
@@ -183,13 +207,110 @@ void px_on_window_close() {
 	net_stop();
 }
 
+void px_usage(const char *name) {
+	printf("Usage: %s [-p port] [-t timeout] [-m bytes] [-N policy] [-s texsize] [-u socket] [-r fps] [-n]\n", name);
+	printf("       %s [-p port] [-t timeout] [-m bytes] [-N policy] [-d] -f WIDTHxHEIGHT[:COLS] host:port ...\n", name);
+	printf("\n");
+	printf("  -p port      Listen on this port (default: 1337)\n");
+	printf("  -t timeout   Disconnect clients idle for this many seconds (default: 60, 0: never)\n");
+	printf("  -m bytes     Per-connection memory budget (default: 262144, 0: unlimited)\n");
+	printf("  -N policy    NUMA placement of the canvas: 'interleave', a node number or\n");
+	printf("               'nic:<iface>' to use the node of that network interface. For\n");
+	printf("               node policies, network workers are pinned to that node, too.\n");
+	printf("  -s texsize   Canvas texture size (default: 1024)\n");
+	printf("  -u socket    Accept local shared memory producers on this unix socket\n");
+	printf("  -r fps       Target frame rate (default: 0, the refresh rate of the display)\n");
+	printf("  -n           Scale the canvas with nearest neighbour instead of linear filtering\n");
+	printf("  -f WxH:COLS  Run as cluster frontend for a WxH canvas, routing PX\n");
+	printf("               commands to the given shards (arranged in COLS columns,\n");
+	printf("               default: 1)\n");
+	printf("  -d           Frontend only: Show the assembled canvas of all shards\n");
+}
+
 int main(int argc, char **argv) {
+	int port = 1337;
+	unsigned int tex_size = 1024;
+	unsigned int route_w = 0, route_h = 0, route_cols = 1;
+	int route_display = 0;
+	int numa_node = -1;
+	const char *ingest_path = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:t:m:N:s:u:r:nf:dh")) != -1) {
+		switch (opt) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 't':
+			net_set_idle_timeout(atoi(optarg));
+			break;
+		case 'm':
+			net_set_memory_budget(strtoul(optarg, NULL, 10));
+			break;
+		case 'N':
+			if ((numa_node = mem_parse_numa(optarg)) == -2) {
+				px_usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 's':
+			tex_size = atoi(optarg);
+			break;
+		case 'u':
+			ingest_path = optarg;
+			break;
+		case 'r':
+			canvas_set_fps(atoi(optarg));
+			break;
+		case 'n':
+			canvas_set_filter(0);
+			break;
+		case 'f':
+			if (sscanf(optarg, "%ux%u:%u", &route_w, &route_h, &route_cols) < 2) {
+				px_usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'd':
+			route_display = 1;
+			break;
+		default:
+			px_usage(argv[0]);
+			return opt != 'h';
+		}
+	}
+
+	trace_init();
+
+	// The network thread (this one) runs next to the memory it writes to.
+	// The render thread is started afterwards and inherits the affinity.
+	if (numa_node >= 0 && mem_pin_thread(numa_node) != 0)
+		printf("Failed to pin network thread to NUMA node %d\n", numa_node);
+
+	if (route_w && route_h) {
+		if (route_display) {
+			canvas_setcb_key(&px_on_key);
+			canvas_start(route_w > route_h ? route_w : route_h, &px_on_window_close);
+		}
+		route_start(route_w, route_h, route_cols, argv + optind, argc - optind,
+				route_display);
+		net_start(port, &route_on_connect, &route_on_read, &route_on_close);
+		return 0;
+	}
+
 	canvas_setcb_key(&px_on_key);
 	canvas_setcb_resize(&px_on_resize);
+	canvas_start(tex_size, &px_on_window_close);
+	px_kernels = canvas_get_kernels();
+
+	if (ingest_path)
+		ingest_start(ingest_path, &px_on_ingest_pixels, &px_on_ingest_rect);
+
+	net_start(port, &px_on_connect, &px_on_read, &px_on_close);
 
-	canvas_start(1024, &px_on_window_close);
+	ingest_stop();
 
-	net_start(1337, &px_on_connect, &px_on_read, &px_on_close);
+	trace_dump(stdout);
 	return 0;
 }
 
@@ -0,0 +1,540 @@
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <err.h>
+
+#include "route.h"
+#include "canvas.h"
+#include "parse.h"
+
+// Wait this long before reconnecting to a lost shard
+#define ROUTE_RECONNECT_SEC 1
+
+// Send a no-op to idle shards this often, so they do not disconnect the
+// frontend (see NET_IDLE_TIMEOUT). Must be shorter than the shard timeout.
+#define ROUTE_KEEPALIVE_SEC 20
+
+// If a shard does not keep up and more than ROUTE_SHARD_HIGH bytes are queued
+// for it, clients writing to it are paused until the queue drained below
+// ROUTE_SHARD_LOW bytes.
+#define ROUTE_SHARD_LOW (256 * 1024)
+#define ROUTE_SHARD_HIGH (1024 * 1024)
+
+// Clients with more than ROUTE_REPLIES_HIGH queued replies (e.g. pipelined
+// reads to a slow shard) are paused until less than ROUTE_REPLIES_LOW are left.
+#define ROUTE_REPLIES_LOW 256
+#define ROUTE_REPLIES_HIGH 1024
+
+// A reply to a client. Replies are queued per client, so answers to reads
+// from different shards are sent back in the same order they were requested.
+typedef struct RouteReply {
+	struct RouteReply *next; // Next reply for the same client
+	struct RouteReply *next_pending; // Next reply waiting for the same shard
+	NetClient *client; // NULL if the client disconnected in the meantime
+	int ready;
+	int error; // Send text as an error and close the connection
+	unsigned int x;
+	unsigned int y;
+	char *text; // Reply text, or NULL to send `line` instead
+	char line[48];
+} RouteReply;
+
+typedef struct RouteSession {
+	NetClient *client;
+	unsigned int offset_x;
+	unsigned int offset_y;
+	RouteReply *head;
+	RouteReply *tail;
+	unsigned int queued; // Number of replies in the queue
+	int replies_held; // Paused because of too many queued replies
+	// Shard this client waits for, if paused because the shard does not keep up
+	struct RouteShard *blocked_on;
+	struct RouteSession *next_blocked;
+} RouteSession;
+
+typedef struct RouteShard {
+	char *host;
+	int port;
+	// Region of the global canvas owned by this shard
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+	struct bufferevent *buf_ev;
+	struct event *reconnect;
+	// Reads sent to this shard that were not answered yet
+	RouteReply *pending_head;
+	RouteReply *pending_tail;
+	// Clients paused until the output buffer drained
+	RouteSession *blocked;
+} RouteShard;
+
+// Global state
+
+static struct event_base *base;
+static RouteShard *route_shards;
+static unsigned int route_count;
+static unsigned int route_cols;
+static unsigned int route_rows;
+static unsigned int route_width;
+static unsigned int route_height;
+static unsigned int route_tile_width;
+static unsigned int route_tile_height;
+static int route_mirror;
+static struct event *route_keepalive;
+
+static unsigned int route_pixelcount = 0;
+static unsigned int route_clientcount = 0;
+
+static void route_connect(RouteShard *shard);
+
+// Helper functions
+
+static inline RouteShard* route_find(unsigned int x, unsigned int y) {
+	unsigned int col = x / route_tile_width;
+	unsigned int row = y / route_tile_height;
+	if (col >= route_cols)
+		col = route_cols - 1;
+	if (row >= route_rows)
+		row = route_rows - 1;
+	return &route_shards[row * route_cols + col];
+}
+
+// Write a decimal number to buf and return a pointer to the first byte after it.
+static inline char* route_fmt_uint(char *buf, uint32_t n) {
+	char tmp[10];
+	int len = 0;
+	do {
+		tmp[len++] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	while (len)
+		*buf++ = tmp[--len];
+	return buf;
+}
+
+// Forward a command to a shard. Pause the client if the shard does not keep up.
+static void route_forward(RouteShard *shard, RouteSession *session,
+		const char *buf, size_t len) {
+	struct evbuffer *output = bufferevent_get_output(shard->buf_ev);
+	evbuffer_add(output, buf, len);
+	if (evbuffer_get_length(output) > ROUTE_SHARD_HIGH && !session->blocked_on) {
+		session->blocked_on = shard;
+		session->next_blocked = shard->blocked;
+		shard->blocked = session;
+		net_pause(session->client);
+	}
+}
+
+// Continue reading from all clients waiting for a shard.
+static void route_unblock(RouteShard *shard) {
+	RouteSession *session = shard->blocked;
+	shard->blocked = NULL;
+	while (session) {
+		RouteSession *next = session->next_blocked;
+		session->blocked_on = NULL;
+		session->next_blocked = NULL;
+		net_resume(session->client);
+		session = next;
+	}
+}
+
+// Append a reply to the queue of a client.
+static void route_queue(RouteSession *session, RouteReply *reply) {
+	if (session->tail)
+		session->tail->next = reply;
+	else
+		session->head = reply;
+	session->tail = reply;
+
+	if (++session->queued > ROUTE_REPLIES_HIGH && !session->replies_held) {
+		session->replies_held = 1;
+		net_pause(session->client);
+	}
+}
+
+// Send a reply now, or queue it behind replies that are still pending.
+static void route_reply(NetClient *client, RouteSession *session, const char *msg) {
+	if (!session->head) {
+		net_send(client, msg);
+		return;
+	}
+
+	RouteReply *reply = calloc(1, sizeof(RouteReply));
+	if (reply == NULL || (reply->text = strdup(msg)) == NULL) {
+		free(reply);
+		net_err(client, "Out of memory");
+		return;
+	}
+	reply->client = client;
+	reply->ready = 1;
+	route_queue(session, reply);
+}
+
+// Send an error and close the connection, after all replies that are still
+// pending. No further commands are read from the client.
+static void route_err(NetClient *client, RouteSession *session, const char *msg) {
+	if (!session->head) {
+		net_err(client, msg);
+		return;
+	}
+
+	RouteReply *reply = calloc(1, sizeof(RouteReply));
+	if (reply == NULL || (reply->text = strdup(msg)) == NULL) {
+		free(reply);
+		net_err(client, "Out of memory");
+		return;
+	}
+	reply->client = client;
+	reply->ready = 1;
+	reply->error = 1;
+	route_queue(session, reply);
+	net_pause(client);
+}
+
+// Send all replies that are ready, in order.
+static void route_flush(NetClient *client, RouteSession *session) {
+	RouteReply *reply;
+	while ((reply = session->head) && reply->ready) {
+		if (reply->error)
+			net_err(client, reply->text);
+		else
+			net_send(client, reply->text ? reply->text : reply->line);
+		session->head = reply->next;
+		session->queued--;
+		free(reply->text);
+		free(reply);
+	}
+	if (!session->head)
+		session->tail = NULL;
+
+	if (session->replies_held && session->queued < ROUTE_REPLIES_LOW) {
+		session->replies_held = 0;
+		net_resume(client);
+	}
+}
+
+// Complete the oldest pending read of a shard.
+static void route_complete(RouteShard *shard, const char *color) {
+	RouteReply *reply = shard->pending_head;
+	if (reply == NULL)
+		return;
+
+	shard->pending_head = reply->next_pending;
+	if (!shard->pending_head)
+		shard->pending_tail = NULL;
+
+	if (reply->client == NULL) {
+		// Client is gone. We are the last one holding this reply.
+		free(reply);
+		return;
+	}
+
+	snprintf(reply->line, sizeof(reply->line), "PX %u %u %.8s", reply->x,
+			reply->y, color);
+	reply->ready = 1;
+
+	RouteSession *session;
+	net_get_user(reply->client, (void**) &session);
+	route_flush(reply->client, session);
+}
+
+// Shard callbacks
+
+static void route_shard_on_read(struct bufferevent *bev, void *ctx) {
+	RouteShard *shard = ctx;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	char *line;
+
+	while ((line = evbuffer_readln(input, NULL, EVBUFFER_EOL_LF))) {
+		unsigned int w, h;
+		if (fast_str_startswith("PX ", line)) {
+			route_complete(shard, strrchr(line, ' ') + 1);
+		} else if (sscanf(line, "SIZE %u %u", &w, &h) == 2) {
+			// Answer to the SIZE sent on connect
+			if (w < shard->width || h < shard->height)
+				printf("Shard %s:%d: Canvas is %ux%u, smaller than its %ux%u tile."
+						" Writes outside of it are lost (start the shard with a larger -s)\n",
+						shard->host, shard->port, w, h, shard->width, shard->height);
+		} else {
+			printf("Shard %s:%d: %s\n", shard->host, shard->port, line);
+		}
+		free(line);
+	}
+}
+
+// Called whenever the output buffer drained to ROUTE_SHARD_LOW bytes or less.
+static void route_shard_on_write(struct bufferevent *bev, void *ctx) {
+	RouteShard *shard = ctx;
+	if (shard->blocked)
+		route_unblock(shard);
+}
+
+static void route_on_keepalive(evutil_socket_t fd, short event, void *arg) {
+	// Shards get shard-local coordinates, so their offset is always 0.
+	for (unsigned int i = 0; i < route_count; i++)
+		if (route_shards[i].buf_ev)
+			bufferevent_write(route_shards[i].buf_ev, "OFFSET 0 0\n", 11);
+}
+
+static void route_shard_on_reconnect(evutil_socket_t fd, short event, void *arg) {
+	route_connect(arg);
+}
+
+static void route_shard_on_event(struct bufferevent *bev, short events, void *ctx) {
+	RouteShard *shard = ctx;
+
+	if (events & BEV_EVENT_CONNECTED) {
+		printf("Shard %s:%d connected\n", shard->host, shard->port);
+		// Check the canvas size of the shard against its tile.
+		bufferevent_write(bev, "SIZE\n", 5);
+		return;
+	}
+
+	printf("Shard %s:%d lost, reconnecting\n", shard->host, shard->port);
+
+	// Answer pending reads as if they were out of range.
+	while (shard->pending_head)
+		route_complete(shard, "000000");
+
+	bufferevent_free(bev);
+	shard->buf_ev = NULL;
+
+	// Queued writes are lost, so there is nothing to wait for.
+	route_unblock(shard);
+
+	struct timeval delay = { ROUTE_RECONNECT_SEC, 0 };
+	evtimer_add(shard->reconnect, &delay);
+}
+
+static void route_connect(RouteShard *shard) {
+	shard->buf_ev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(shard->buf_ev, route_shard_on_read, route_shard_on_write,
+			route_shard_on_event, shard);
+	bufferevent_setwatermark(shard->buf_ev, EV_WRITE, ROUTE_SHARD_LOW, 0);
+	bufferevent_enable(shard->buf_ev, EV_READ | EV_WRITE);
+
+	// Output is buffered until the connection is established.
+	if (bufferevent_socket_connect_hostname(shard->buf_ev, NULL, AF_INET,
+			shard->host, shard->port) < 0) {
+		bufferevent_free(shard->buf_ev);
+		shard->buf_ev = NULL;
+		struct timeval delay = { ROUTE_RECONNECT_SEC, 0 };
+		evtimer_add(shard->reconnect, &delay);
+	}
+}
+
+// Server callbacks
+
+void route_on_connect(NetClient *client) {
+	RouteSession *session = calloc(1, sizeof(RouteSession));
+	if (session == NULL) {
+		net_err(client, "Out of memory");
+		return;
+	}
+	session->client = client;
+	net_set_user(client, session);
+	route_clientcount++;
+}
+
+void route_on_close(NetClient *client, int error) {
+	RouteSession *session;
+	net_get_user(client, (void**) &session);
+	if (session == NULL)
+		return;
+
+	if (session->blocked_on) {
+		RouteSession **it = &session->blocked_on->blocked;
+		while (*it != session)
+			it = &(*it)->next_blocked;
+		*it = session->next_blocked;
+	}
+
+	// Pending replies are still referenced by a shard and freed there.
+	RouteReply *reply = session->head;
+	while (reply) {
+		RouteReply *next = reply->next;
+		if (reply->ready) {
+			free(reply->text);
+			free(reply);
+		} else {
+			reply->client = NULL;
+		}
+		reply = next;
+	}
+
+	net_set_user(client, NULL);
+	free(session);
+	route_clientcount--;
+}
+
+void route_on_read(NetClient *client, char *line) {
+	RouteSession *session;
+	net_get_user(client, (void**) &session);
+
+	if (fast_str_startswith("PX ", line)) {
+		ParsePx px;
+		const char *error = parse_px(line + 3, &px);
+		if (error) {
+			route_err(client, session, error);
+			return;
+		}
+
+		uint32_t gx = px.x + session->offset_x;
+		uint32_t gy = px.y + session->offset_y;
+		RouteShard *shard = NULL;
+		if (gx < route_width && gy < route_height)
+			shard = route_find(gx, gy);
+
+		// PX <x> <y> -> Ask the owning shard, answer in order
+		if (px.color_len == 0) {
+			if (shard == NULL || shard->buf_ev == NULL) {
+				char str[64];
+				snprintf(str, sizeof(str), "PX %u %u 000000", px.x, px.y);
+				route_reply(client, session, str);
+				return;
+			}
+
+			RouteReply *reply = calloc(1, sizeof(RouteReply));
+			if (reply == NULL) {
+				net_err(client, "Out of memory");
+				return;
+			}
+			reply->client = client;
+			reply->x = px.x;
+			reply->y = px.y;
+			route_queue(session, reply);
+
+			if (shard->pending_tail)
+				shard->pending_tail->next_pending = reply;
+			else
+				shard->pending_head = reply;
+			shard->pending_tail = reply;
+
+			char buf[32] = "PX ";
+			char *out = route_fmt_uint(buf + 3, gx - shard->x);
+			*out++ = ' ';
+			out = route_fmt_uint(out, gy - shard->y);
+			*out++ = '\n';
+			route_forward(shard, session, buf, out - buf);
+			return;
+		}
+
+		route_pixelcount++;
+
+		// Pipelined, shards do not answer writes. Writes to lost shards are
+		// dropped, and not shown on the mirror either.
+		if (shard == NULL || shard->buf_ev == NULL)
+			return;
+
+		if (route_mirror)
+			canvas_set_px(gx, gy, px.rgba);
+
+		char buf[48] = "PX ";
+		char *out = route_fmt_uint(buf + 3, gx - shard->x);
+		*out++ = ' ';
+		out = route_fmt_uint(out, gy - shard->y);
+		*out++ = ' ';
+		memcpy(out, px.color, px.color_len);
+		out += px.color_len;
+		*out++ = '\n';
+		route_forward(shard, session, buf, out - buf);
+
+	} else if (fast_str_startswith("OFFSET ", line)) {
+
+		uint32_t x, y;
+		const char *error = parse_offset(line + 7, &x, &y);
+		if (error) {
+			route_err(client, session, error);
+			return;
+		}
+
+		session->offset_x = x;
+		session->offset_y = y;
+
+	} else if (fast_str_startswith("COMPRESS", line)) {
+
+		if (net_set_compressed(client) != 0)
+			route_err(client, session, "Failed to initialize decompression");
+
+	} else if (fast_str_startswith("SIZE", line)) {
+
+		char str[64];
+		snprintf(str, 64, "SIZE %d %d", route_width, route_height);
+		route_reply(client, session, str);
+
+	} else if (fast_str_startswith("STATS", line)) {
+
+		NetStats stats;
+		net_get_stats(&stats);
+		size_t shardbuf = 0;
+		for (unsigned int i = 0; i < route_count; i++)
+			if (route_shards[i].buf_ev)
+				shardbuf += evbuffer_get_length(bufferevent_get_output(route_shards[i].buf_ev));
+		char str[192];
+		snprintf(str, sizeof(str), "STATS px:%u conn:%u paused:%u held:%u killed:%u evicted:%u outbuf:%zu reclaimed:%zu shards:%u shardbuf:%zu",
+				route_pixelcount, route_clientcount, stats.paused, stats.held,
+				stats.killed, stats.evicted, stats.buffered, stats.reclaimed,
+				route_count, shardbuf);
+		route_reply(client, session, str);
+
+	} else if (fast_str_startswith("HELP", line)) {
+
+		route_reply(client, session, PARSE_HELP);
+
+	} else {
+
+		route_err(client, session, "Unknown command");
+
+	}
+}
+
+// Public functions
+
+void route_start(unsigned int width, unsigned int height, unsigned int cols,
+		char **shards, unsigned int count, int mirror) {
+
+	if (count == 0 || cols == 0 || count % cols != 0)
+		errx(1, "Number of shards must be a multiple of the number of columns");
+
+	base = net_base();
+	route_width = width;
+	route_height = height;
+	route_count = count;
+	route_cols = cols;
+	route_rows = count / cols;
+	route_tile_width = (width + cols - 1) / cols;
+	route_tile_height = (height + route_rows - 1) / route_rows;
+	route_mirror = mirror;
+
+	route_shards = calloc(count, sizeof(RouteShard));
+	if (route_shards == NULL)
+		err(1, "Failed to allocate shards");
+
+	for (unsigned int i = 0; i < count; i++) {
+		RouteShard *shard = &route_shards[i];
+		char *sep = strrchr(shards[i], ':');
+		if (sep == NULL)
+			errx(1, "Invalid shard address (expected host:port): %s", shards[i]);
+
+		shard->host = strndup(shards[i], sep - shards[i]);
+		shard->port = atoi(sep + 1);
+		shard->x = (i % cols) * route_tile_width;
+		shard->y = (i / cols) * route_tile_height;
+		shard->width = route_tile_width;
+		shard->height = route_tile_height;
+		shard->reconnect = evtimer_new(base, route_shard_on_reconnect, shard);
+
+		printf("Shard %s:%d owns %ux%u+%u+%u\n", shard->host, shard->port,
+				shard->width, shard->height, shard->x, shard->y);
+		route_connect(shard);
+	}
+
+	struct timeval interval = { ROUTE_KEEPALIVE_SEC, 0 };
+	route_keepalive = event_new(base, -1, EV_PERSIST, route_on_keepalive, NULL);
+	evtimer_add(route_keepalive, &interval);
+}
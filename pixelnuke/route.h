@@ -0,0 +1,23 @@
+#ifndef ROUTE_H_
+#define ROUTE_H_
+
+#include "net.h"
+
+// Cluster frontend: Accept normal client connections and route PX commands by
+// coordinate to a number of pixelnuke instances (shards), each owning a
+// rectangular region of a large canvas. Shards are arranged in a grid with
+// `cols` columns, in row-major order. With cols=1, each shard owns a
+// horizontal stripe.
+
+// Connect to all shards (given as host:port strings) using the net_base() event loop.
+// If `mirror` is != 0, all writes are also applied to the local canvas, which
+// then shows the assembled image of all shards.
+void route_start(unsigned int width, unsigned int height, unsigned int cols,
+		char **shards, unsigned int count, int mirror);
+
+// Server callbacks, to be passed to net_start()
+void route_on_connect(NetClient *client);
+void route_on_read(NetClient *client, char *line);
+void route_on_close(NetClient *client, int error);
+
+#endif /* ROUTE_H_ */
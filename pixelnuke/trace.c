@@ -0,0 +1,207 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+
+#include "trace.h"
+
+// Log-linear (HDR style) histogram: Values below 2^TRACE_SUB_BITS get their
+// own bucket, larger values are grouped by magnitude with 2^TRACE_SUB_BITS
+// linear sub-buckets each. Relative error is below 1/2^TRACE_SUB_BITS.
+#define TRACE_SUB_BITS 4
+#define TRACE_SUB_COUNT (1 << TRACE_SUB_BITS)
+#define TRACE_BUCKETS ((64 - TRACE_SUB_BITS + 1) * TRACE_SUB_COUNT)
+
+typedef struct TraceHist {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[TRACE_BUCKETS];
+} TraceHist;
+
+// Histograms of a single thread. Only written by the owning thread.
+typedef struct TraceThread {
+	TraceHist hist[TRACE_STAGES];
+	struct TraceThread *next;
+} TraceThread;
+
+static const char *trace_stage_names[TRACE_STAGES] = { "queue", "parse",
+		"apply", "upload", "visible", "frame" };
+
+// Global state
+
+static unsigned int trace_sample_rate = TRACE_SAMPLE_RATE;
+// Nanoseconds per tick. A double, as 128 bit integers are not available on 32 bit targets.
+static double trace_ns_per_tick = 1.0;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceThread *trace_threads = NULL;
+
+static uint64_t trace_visible_pending = 0;
+static uint64_t trace_visible_staged = 0;
+
+__thread unsigned int trace_countdown = 1;
+__thread uint64_t trace_read_ts = 0;
+static __thread TraceThread *trace_thread = NULL;
+
+// Helper functions
+
+static inline unsigned int trace_bucket(uint64_t ns) {
+	if (ns < TRACE_SUB_COUNT)
+		return ns;
+	int mag = 63 - __builtin_clzll(ns);
+	unsigned int sub = (ns >> (mag - TRACE_SUB_BITS)) & (TRACE_SUB_COUNT - 1);
+	return (mag - TRACE_SUB_BITS + 1) * TRACE_SUB_COUNT + sub;
+}
+
+// Highest value that falls into a bucket
+static inline uint64_t trace_bucket_value(unsigned int bucket) {
+	if (bucket < TRACE_SUB_COUNT)
+		return bucket;
+	int mag = bucket / TRACE_SUB_COUNT + TRACE_SUB_BITS - 1;
+	uint64_t sub = bucket % TRACE_SUB_COUNT;
+	uint64_t width = 1ull << (mag - TRACE_SUB_BITS);
+	return ((TRACE_SUB_COUNT + sub) << (mag - TRACE_SUB_BITS)) + width - 1;
+}
+
+static inline uint64_t trace_ticks_to_ns(uint64_t ticks) {
+	return (uint64_t) (ticks * trace_ns_per_tick);
+}
+
+static TraceThread* trace_thread_get() {
+	if (trace_thread)
+		return trace_thread;
+
+	TraceThread *t = calloc(1, sizeof(TraceThread));
+	if (t == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&trace_lock);
+	t->next = trace_threads;
+	trace_threads = t;
+	pthread_mutex_unlock(&trace_lock);
+
+	return trace_thread = t;
+}
+
+static uint64_t trace_percentile(TraceHist *h, double p) {
+	uint64_t rank = h->count * p;
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < TRACE_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > rank)
+			return trace_bucket_value(i) < h->max ? trace_bucket_value(i) : h->max;
+	}
+	return h->max;
+}
+
+// Public functions
+
+void trace_init() {
+#if defined(__x86_64__) || defined(__i386__)
+	struct timespec t1, t2, sleep = { 0, 20000000 };
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	uint64_t c1 = trace_now();
+	nanosleep(&sleep, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	uint64_t c2 = trace_now();
+
+	uint64_t ns = (t2.tv_sec - t1.tv_sec) * 1000000000ull + t2.tv_nsec - t1.tv_nsec;
+	if (c2 > c1)
+		trace_ns_per_tick = (double) ns / (c2 - c1);
+#endif
+}
+
+int trace_sample_reset() {
+	unsigned int rate = __atomic_load_n(&trace_sample_rate, __ATOMIC_RELAXED);
+	trace_countdown = rate ? rate : UINT_MAX;
+	return rate != 0;
+}
+
+void trace_set_sample_rate(unsigned int rate) {
+	__atomic_store_n(&trace_sample_rate, rate, __ATOMIC_RELAXED);
+	trace_sample_reset();
+}
+
+unsigned int trace_get_sample_rate() {
+	return __atomic_load_n(&trace_sample_rate, __ATOMIC_RELAXED);
+}
+
+void trace_record(int stage, uint64_t ticks) {
+	TraceThread *t = trace_thread_get();
+	if (t == NULL || stage < 0 || stage >= TRACE_STAGES)
+		return;
+
+	uint64_t ns = trace_ticks_to_ns(ticks);
+	TraceHist *h = &t->hist[stage];
+	h->buckets[trace_bucket(ns)]++;
+	h->count++;
+	if (ns > h->max)
+		h->max = ns;
+}
+
+void trace_px_applied(uint64_t now) {
+	uint64_t expected = 0;
+	// Only the oldest not yet visible sample is tracked.
+	__atomic_compare_exchange_n(&trace_visible_pending, &expected, now, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+void trace_frame_staged() {
+	if (trace_visible_staged)
+		return;
+	trace_visible_staged = __atomic_exchange_n(&trace_visible_pending, 0,
+			__ATOMIC_RELAXED);
+}
+
+void trace_frame_shown() {
+	// Data staged for a frame is uploaded to the texture and shown in the same frame.
+	if (trace_visible_staged)
+		trace_record(TRACE_VISIBLE, trace_now() - trace_visible_staged);
+	trace_visible_staged = 0;
+}
+
+void trace_format(char *buf, size_t len) {
+	TraceHist *merged = calloc(1, sizeof(TraceHist));
+	size_t pos = 0;
+
+	if (merged == NULL) {
+		snprintf(buf, len, "TRACE error:nomem");
+		return;
+	}
+
+	pos += snprintf(buf, len, "TRACE rate:%u", trace_get_sample_rate());
+
+	for (int stage = 0; stage < TRACE_STAGES && pos < len; stage++) {
+		memset(merged, 0, sizeof(TraceHist));
+
+		// Other threads may still be writing. Slightly stale numbers are fine here.
+		pthread_mutex_lock(&trace_lock);
+		for (TraceThread *t = trace_threads; t; t = t->next) {
+			TraceHist *h = &t->hist[stage];
+			for (unsigned int i = 0; i < TRACE_BUCKETS; i++)
+				merged->buckets[i] += h->buckets[i];
+			merged->count += h->count;
+			if (h->max > merged->max)
+				merged->max = h->max;
+		}
+		pthread_mutex_unlock(&trace_lock);
+
+		pos += snprintf(buf + pos, len - pos,
+				"\nTRACE %s n:%" PRIu64 " p50:%" PRIu64 " p90:%" PRIu64
+				" p99:%" PRIu64 " p999:%" PRIu64 " max:%" PRIu64,
+				trace_stage_names[stage], merged->count,
+				trace_percentile(merged, 0.5), trace_percentile(merged, 0.9),
+				trace_percentile(merged, 0.99), trace_percentile(merged, 0.999),
+				merged->max);
+	}
+
+	free(merged);
+}
+
+void trace_dump(FILE *out) {
+	char buf[1024];
+	trace_format(buf, sizeof(buf));
+	fprintf(out, "%s\n", buf);
+}
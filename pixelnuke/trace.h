@@ -0,0 +1,88 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Latency tracing. Only every TRACE_SAMPLE_RATE-th line is measured, so the
+// cost for all other lines is a thread-local decrement and a branch.
+// Can be changed at runtime with trace_set_sample_rate(). 0 disables tracing.
+#ifndef TRACE_SAMPLE_RATE
+#define TRACE_SAMPLE_RATE 1024
+#endif
+
+// Measured stages of a pixel, from socket to screen.
+#define TRACE_QUEUE 0   // Data read from socket -> line dispatched
+#define TRACE_PARSE 1   // Line dispatched -> command parsed
+#define TRACE_APPLY 2   // Command parsed -> pixel written to canvas
+#define TRACE_UPLOAD 3  // Time to copy the canvas into a PBO (per frame)
+#define TRACE_VISIBLE 4 // Pixel written -> first frame showing it swapped
+#define TRACE_FRAME 5   // Time between two swaps (every frame, not sampled)
+#define TRACE_STAGES 6
+
+// Optional USDT probes (build with `make usdt`, needs systemtap-sdt-dev)
+#ifdef TRACE_USDT
+#include <sys/sdt.h>
+#define TRACE_PROBE(name) DTRACE_PROBE(pixelnuke, name)
+#define TRACE_PROBE1(name, a) DTRACE_PROBE1(pixelnuke, name, a)
+#define TRACE_PROBE3(name, a, b, c) DTRACE_PROBE3(pixelnuke, name, a, b, c)
+#else
+#define TRACE_PROBE(name)
+#define TRACE_PROBE1(name, a)
+#define TRACE_PROBE3(name, a, b, c)
+#endif
+
+extern __thread unsigned int trace_countdown;
+// Set by the network thread each time new data was read from a socket.
+extern __thread uint64_t trace_read_ts;
+
+// Return a timestamp in ticks (TSC if available, nanoseconds otherwise).
+static inline uint64_t trace_now() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+int trace_sample_reset();
+
+// Return 1 if the current event should be measured, 0 otherwise.
+static inline int trace_sample() {
+	if (__builtin_expect(--trace_countdown != 0, 1))
+		return 0;
+	return trace_sample_reset();
+}
+
+// Calibrate the tick counter. Call once before any other trace_* function.
+void trace_init();
+
+void trace_set_sample_rate(unsigned int rate);
+unsigned int trace_get_sample_rate();
+
+// Add a duration (in ticks) to the histogram of the given stage for the calling thread.
+void trace_record(int stage, uint64_t ticks);
+
+// Remember the time a sampled pixel was written to the canvas, so the render
+// thread can measure when it becomes visible.
+void trace_px_applied(uint64_t now);
+// Called by the render thread after the canvas was copied to the upload buffer.
+void trace_frame_staged();
+// Called by the render thread after a frame was swapped to the screen.
+void trace_frame_shown();
+
+// Write a one-line summary per stage (merged over all threads) into buf.
+// Lines are separated by \n, but there is no trailing line break.
+void trace_format(char *buf, size_t len);
+
+// Print the summary to a stream (e.g. on shutdown)
+void trace_dump(FILE *out);
+
+#endif /* TRACE_H_ */
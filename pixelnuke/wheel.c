@@ -0,0 +1,88 @@
+#include <stddef.h>
+
+#include "wheel.h"
+
+// Helper functions
+
+static inline void wheel_link(WheelNode *head, WheelNode *node) {
+	node->prev = head->prev;
+	node->next = head;
+	head->prev->next = node;
+	head->prev = node;
+}
+
+// Link a node into the slot matching node->expires (which must be >= now).
+static void wheel_insert(TimerWheel *wheel, WheelNode *node) {
+	// Pick the lowest level that can hold the delay without wrapping around.
+	uint64_t delta = node->expires - wheel->now;
+	int level = 0;
+	while (level < WHEEL_LEVELS - 1 && delta >= (1ull << (WHEEL_BITS * (level + 1))))
+		level++;
+
+	unsigned int slot = (node->expires >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+	wheel_link(&wheel->slots[level][slot], node);
+}
+
+// Move all nodes of a higher level slot to the levels below.
+static void wheel_cascade(TimerWheel *wheel, WheelNode *head) {
+	WheelNode *node = head->next;
+	head->next = head->prev = head;
+
+	while (node != head) {
+		WheelNode *next = node->next;
+		wheel_insert(wheel, node);
+		node = next;
+	}
+}
+
+// Public functions
+
+void wheel_init(TimerWheel *wheel) {
+	wheel->now = 0;
+	for (int level = 0; level < WHEEL_LEVELS; level++) {
+		for (int i = 0; i < WHEEL_SIZE; i++) {
+			WheelNode *head = &wheel->slots[level][i];
+			head->next = head->prev = head;
+		}
+	}
+}
+
+void wheel_add(TimerWheel *wheel, WheelNode *node, uint64_t expires) {
+	if (node->next)
+		wheel_remove(node);
+
+	if (expires <= wheel->now)
+		expires = wheel->now + 1;
+	else if (expires - wheel->now > WHEEL_MAX)
+		expires = wheel->now + WHEEL_MAX;
+	node->expires = expires;
+	wheel_insert(wheel, node);
+}
+
+void wheel_remove(WheelNode *node) {
+	if (!node->next)
+		return;
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->next = node->prev = NULL;
+}
+
+void wheel_tick(TimerWheel *wheel, wheel_on_expire cb, void *arg) {
+	uint64_t now = ++wheel->now;
+
+	// Whenever a lower level wraps around, the next slot of the level above
+	// is due and gets distributed to the lower levels.
+	for (int level = 1; level < WHEEL_LEVELS; level++) {
+		if (now & ((1ull << (WHEEL_BITS * level)) - 1))
+			break;
+		unsigned int slot = (now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+		wheel_cascade(wheel, &wheel->slots[level][slot]);
+	}
+
+	WheelNode *head = &wheel->slots[0][now & (WHEEL_SIZE - 1)];
+	while (head->next != head) {
+		WheelNode *node = head->next;
+		wheel_remove(node);
+		(*cb)(node, arg);
+	}
+}
@@ -0,0 +1,42 @@
+#ifndef WHEEL_H_
+#define WHEEL_H_
+
+#include <stdint.h>
+
+// Hierarchical timer wheel with a resolution of one tick. Adding, removing and
+// expiring a timer is O(1), no matter how many timers are active. Timers
+// further away than WHEEL_MAX ticks fire after WHEEL_MAX ticks.
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 3
+#define WHEEL_MAX ((1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+// Embed this into the structure that should be scheduled.
+typedef struct WheelNode {
+	struct WheelNode *next;
+	struct WheelNode *prev;
+	uint64_t expires;
+} WheelNode;
+
+typedef struct TimerWheel {
+	uint64_t now;
+	WheelNode slots[WHEEL_LEVELS][WHEEL_SIZE];
+} TimerWheel;
+
+// Called for each expired node. The node is already removed from the wheel
+// and may be added again or freed by the callback.
+typedef void (*wheel_on_expire)(WheelNode *node, void *arg);
+
+void wheel_init(TimerWheel *wheel);
+
+// Schedule (or re-schedule) a node to expire at the given tick.
+void wheel_add(TimerWheel *wheel, WheelNode *node, uint64_t expires);
+
+// Remove a node from the wheel. Does nothing if the node is not scheduled.
+void wheel_remove(WheelNode *node);
+
+// Advance the wheel by one tick and expire all nodes that are due.
+void wheel_tick(TimerWheel *wheel, wheel_on_expire cb, void *arg);
+
+#endif /* WHEEL_H_ */